@@ -3,6 +3,12 @@
 #include "ActionInitialization.hh"
 
 #include "G4RunManager.hh"
+#ifdef G4MULTITHREADED
+#include "G4MTRunManager.hh"
+    #ifdef GEANT_VERSION_FROM_11
+    #include "G4TaskRunManager.hh"
+    #endif
+#endif
 #include "G4UImanager.hh"
 #include "G4StepLimiterPhysics.hh"
 #include "G4VisExecutive.hh"
@@ -32,13 +38,64 @@ int main(int argc, char** argv)
     SessionManager& SM = SessionManager::getInstance();
     if (argc < 2)
         SM.terminateSession("Config file not provided as the first argument");
+    for (int i = 2; i < argc; i++)
+        if (std::string(argv[i]) == "--stage-input") SM.setStageInput(); // affects how the config is read
     SM.ReadConfig(argv[1]);
     bool bGui = SM.isGuiMode();
 
+    // --resume: continue from the last checkpoint
+    // --estimate N: simulate N randomly selected events, report projected CPU time, output size and memory in the receipt
+    // server mode: G4ants config.json --server fifo [--idle]
+    // --idle is used by the server when it restarts after a failed job: initialize and wait for the next job
+    // --index: write the event index of the file with primaries and exit
+    // --stage-input: started by the previous stage of a two-stage simulation (see SaveExitParticles NextStage), primaries come through stdin
+    bool bIdle = false;
+    bool bIndex = false;
+    for (int i = 2; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if      (arg == "--resume")               SM.setResume(true);
+        else if (arg == "--estimate" && i+1 < argc) SM.setEstimateMode(std::max(1, std::atoi(argv[++i])));
+        else if (arg == "--server" && i+1 < argc) SM.configureServer(argv[++i], argv[1]);
+        else if (arg == "--idle")                 bIdle = true;
+        else if (arg == "--index")                bIndex = true;
+    }
+
+    if (bIndex)
+    {
+        SM.buildInputIndex();
+        return 0;
+    }
+
     G4UIExecutive* ui =  0;
     if (bGui) ui = new G4UIExecutive(argc, argv);
 
-    G4RunManager* runManager = new G4RunManager;
+    SM.initializeRandomGenerator(); // before the run manager: in MT mode the master engine is used to seed the workers
+
+    G4RunManager* runManager = nullptr;
+#ifdef G4MULTITHREADED
+    if (SM.isTaskBased())
+    {
+    #ifdef GEANT_VERSION_FROM_11
+        G4TaskRunManager * taskRunManager = new G4TaskRunManager;
+        taskRunManager->SetNumberOfThreads(SM.getNumThreads()); // size of the thread pool
+        if (SM.getTaskGrainSize() > 0) taskRunManager->SetGrainsize(SM.getTaskGrainSize());
+        runManager = taskRunManager;
+    #else
+        std::cout << "Task-based run manager requires Geant4 version 11 or later, using the MT run manager" << std::endl;
+    #endif
+    }
+    if (!runManager && SM.getNumThreads() > 1)
+    {
+        G4MTRunManager * mtRunManager = new G4MTRunManager;
+        mtRunManager->SetNumberOfThreads(SM.getNumThreads());
+        runManager = mtRunManager;
+    }
+#else
+    if (SM.getNumThreads() > 1 || SM.isTaskBased())
+        std::cout << "Geant4 was built without multithreading support, running with one thread" << std::endl;
+#endif
+    if (!runManager) runManager = new G4RunManager;
     G4GDMLParser parser;
     parser.Read(SM.getGDML(), false); //false - no validation
     // need to implement own G4excpetion-based handler class  ->  SM.terminateSession("Error parsing GDML file");
@@ -93,24 +150,32 @@ int main(int argc, char** argv)
         UImanager->ApplyCommand("/control/saveHistory");
     }
 
-    SM.startSession();
-
     G4VisManager* visManager = 0;
 
     if (!SM.isGuiMode())
-        SM.runSimulation();
+    {
+        if (!bIdle)
+        {
+            SM.startSession();
+            SM.runSimulation();
+            SM.endSession(); // before the run manager is deleted: it owns the sensitive detectors, including the monitors
+        }
+
+        if (SM.isServerMode()) SM.runServer();
+    }
     else
     {
+        SM.startSession();
 
         visManager = new G4VisExecutive("Quiet");
         visManager->Initialize();
         UImanager->ApplyCommand("/control/execute vis.mac");
         ui->SessionStart();
+
+        SM.endSession();
     }
 
     delete visManager;
     delete runManager;
     delete ui;
-
-    SM.endSession();
 }
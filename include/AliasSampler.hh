@@ -0,0 +1,22 @@
+#ifndef AliasSampler_h
+#define AliasSampler_h
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Samples an index from a discrete distribution in O(1) (Walker's alias method, Vose's construction)
+class AliasSampler
+{
+public:
+    bool build(const std::vector<double> & weights); // false if a weight is negative or all are zero
+
+    size_t sample(double u) const; // u - uniform in [0, 1); its integer and fractional parts (times the size) select the column and the side
+    size_t size() const {return Probability.size();}
+
+private:
+    std::vector<double>   Probability; // of the column's own index
+    std::vector<uint32_t> Alias;
+};
+
+#endif // AliasSampler_h
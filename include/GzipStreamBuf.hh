@@ -0,0 +1,31 @@
+#ifndef GzipStreamBuf_h
+#define GzipStreamBuf_h
+
+#include <streambuf>
+#include <string>
+#include <vector>
+
+struct gzFile_s;
+
+// Input stream buffer decompressing a gzip file on the fly (zlib)
+// Positions are offsets in the decompressed data; seeking backwards restarts the decompression, so it is slow
+class GzipStreamBuf : public std::streambuf
+{
+public:
+    ~GzipStreamBuf();
+
+    bool open(const std::string & fileName);
+
+    static bool isGzipFile(const std::string & fileName); // by the magic bytes, or by the extension if the file is not a regular one
+
+protected:
+    int_type underflow() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+    gzFile_s * File = nullptr;
+    std::vector<char> Buffer;
+};
+
+#endif // GzipStreamBuf_h
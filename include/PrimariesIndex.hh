@@ -0,0 +1,51 @@
+#ifndef PrimariesIndex_h
+#define PrimariesIndex_h
+
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+class PrimariesReader;
+
+// Event offsets of a file with primaries, kept in the sidecar file <file with primaries>.index
+// Entry i describes the i-th event of the file, so any event range can be positioned without scanning the file
+// The index is ignored if the file with primaries was modified after the index was built
+class PrimariesIndex
+{
+public:
+    struct Entry
+    {
+        uint64_t Position    = 0;   // PrimariesReader::getPosition() at this event
+        uint64_t LineNumber  = 0;   // line of the event header in text formats
+        uint64_t IdOffset    = 0;   // event header text (PrimariesReader::NextEventId) in the id section after the entries
+        uint64_t IdSize      = 0;
+    };
+
+    static std::string makeFileName(const std::string & primariesFileName) {return primariesFileName + ".index";}
+
+    // scans the file with the reader (positioned at the first event); returns the number of events, terminates the session on errors
+    static long build(PrimariesReader & reader, const std::string & primariesFileName);
+
+    bool open(const std::string & primariesFileName); // false if there is no up-to-date index
+
+    long  size() const {return NumEvents;}
+    Entry getEntry(long iEvent);
+    std::string getEventId(const Entry & e); // the event header exactly as it is in the file
+    long  findEvent(long position); // index of the event with the records at the position; -1 if there is no such event
+
+private:
+    std::ifstream Stream;
+    long NumEvents = 0;
+
+    struct Header
+    {
+        char     Magic[8]    = {'G','4','a','I','D','X','2','\0'};
+        uint64_t FileSize    = 0;   // of the file with primaries at the time of indexing
+        int64_t  FileTime    = 0;   // modification time, ns
+        uint64_t NumEvents   = 0;
+    };
+
+    static bool readFileStamp(const std::string & fileName, Header & h);
+};
+
+#endif // PrimariesIndex_h
@@ -0,0 +1,256 @@
+#ifndef PrimariesReader_h
+#define PrimariesReader_h
+
+#include "SessionManager.hh"
+#include "PrimariesV2Format.hh"
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <fstream>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class G4ParticleDefinition;
+
+// Reads the file with primaries event by event
+// The header of the next event ("#number") is read ahead and kept in NextEventId; it is empty when there are no more events
+// Format errors are reported with SessionManager::terminateSession
+class PrimariesReader
+{
+public:
+    virtual ~PrimariesReader() {}
+
+    virtual bool open(const std::string & fileName) = 0; // reads the header of the first event; false if the file cannot be opened
+
+    virtual void readEvent(std::vector<ParticleRecord> & primaries) = 0; // appends the records of the current event and reads the header of the next one
+    virtual bool skipEvent() = 0;                                        // skips the records of the current event and reads the header of the next one
+
+    // position of the current event (reader-specific, e.g. of its records), used to count the events, for the checkpoints and in the index
+    // lineNumber: line of the event header in text formats (see getLineNumber), -1 - unknown
+    virtual long getPosition() = 0;
+    virtual void setPosition(long position, const std::string & eventId, long lineNumber = -1) = 0;
+    virtual long getLineNumber() const {return 0;}
+
+    // particle names used in the file (as far as they can be found cheaply), to be resolved in the master thread in advance
+    virtual void collectParticleNames(std::unordered_set<std::string> & /*names*/, size_t /*maxBytes*/) const {}
+
+    bool isExhausted() const {return NextEventId.empty();}
+    virtual bool isSeekable() const {return true;} // false for pipes: no positioning, so no event counting, checkpoints or index
+
+    std::string NextEventId;
+
+    // set by the reader thread (see PrefetchingPrimariesReader): the names not resolved yet are not looked up in Geant4 (its particle tables are per thread),
+    // the records get nullptr and the pair (index in the vector given to readEvent, name) is added here to be resolved by the consumer
+    std::vector<std::pair<size_t, std::string>> * UnresolvedNames = nullptr;
+
+    G4ParticleDefinition * findParticle(const std::string & name, size_t index); // terminates the session if not found
+};
+
+// Base for the readers working through std::istream: plain files and pipes, gzip-compressed files are decompressed on the fly
+class StreamPrimariesReader : public PrimariesReader
+{
+public:
+    bool isSeekable() const override {return !bPipe;}
+
+protected:
+    bool openStream(const std::string & fileName); // false if the file cannot be opened
+
+    bool bPipe = false; // stdin, FIFO: reading blocks until the writer provides data or closes its end
+    std::ifstream File;
+    std::unique_ptr<std::streambuf> Decompressor;
+    std::istream Stream{nullptr};
+};
+
+// Version 2 of the G4ants binary format (see BinaryPrimariesReader): the dictionary of the particle names and the record decoding,
+// shared by the stream and the memory-mapped readers
+class BinaryPrimariesV2 : public PrimariesV2Format
+{
+public:
+    void setNames(std::vector<std::string> && names);
+    const std::vector<std::string> & getNames() const {return Names;}
+
+    // appends numRecords records stored consecutively at data (no alignment required); terminates the session on an unknown particle index
+    void decode(const char * data, uint32_t numRecords, std::vector<ParticleRecord> & primaries, PrimariesReader & reader);
+
+private:
+    std::vector<std::string> Names;
+    std::vector<G4ParticleDefinition*> Particles; // resolved on the first use
+};
+
+// G4ants binary formats, the version is recognized by the first bytes
+// Version 1: per event 0xEE + int32 event number, then per particle 0xFF + zero-terminated name + 8 doubles
+//            (energy, x, y, z, dx, dy, dz, time), or 0xFE + the same + double weight
+// Version 2: "G4antsP2", uint32 number of particle names, per name uint16 length + name (no terminator);
+//            then per event int32 event number + uint32 number of records, followed by the fixed-size records:
+//            int32 index in the names, float weight, the same 8 doubles; the weight is stored as is if the index has the bit 0x40000000 set,
+//            otherwise 0 stands for weight 1 (see PrimariesV2Format; PrimariesV2Writer writes this version)
+// All numbers in the byte order of the machine
+class BinaryPrimariesReader : public StreamPrimariesReader
+{
+public:
+    bool open(const std::string & fileName) override;
+
+    void readEvent(std::vector<ParticleRecord> & primaries) override;
+    bool skipEvent() override;
+
+    long getPosition() override;
+    void setPosition(long position, const std::string & eventId, long lineNumber = -1) override;
+
+    void collectParticleNames(std::unordered_set<std::string> & names, size_t maxBytes) const override; // version 2: the names of the dictionary
+
+protected:
+    int Version = 1;
+
+    // version 2
+    BinaryPrimariesV2 V2;
+    std::vector<char> Records;                      // reused buffer, the records of an event are read in chunks of at most MaxChunkRecords
+    long     EventPosition = 0;                     // of the header of the current event
+    uint32_t NumRecords    = 0;                     // of the current event
+
+    static constexpr uint32_t MaxChunkRecords = 1 << 16; // a corrupted record count does not allocate more than the file provides
+
+    void readV2Dictionary();
+    bool readV2EventHeader(); // false at the end of the file
+};
+
+// Same formats parsed straight out of the memory-mapped file
+class MappedBinaryPrimariesReader : public PrimariesReader
+{
+public:
+    ~MappedBinaryPrimariesReader();
+
+    bool open(const std::string & fileName) override; // false also if the file cannot be mapped (e.g. it is a pipe or compressed)
+
+    void readEvent(std::vector<ParticleRecord> & primaries) override;
+    bool skipEvent() override;
+
+    long getPosition() override {return (long)(Version == 2 ? EventPosition : Pos);}
+    void setPosition(long position, const std::string & eventId, long lineNumber = -1) override;
+
+    void collectParticleNames(std::unordered_set<std::string> & names, size_t maxBytes) const override; // v1: of the records within maxBytes from the current position
+
+protected:
+    const char * Data = nullptr;
+    size_t       Size = 0;
+    size_t       Pos  = 0;
+    int          Version = 1;
+
+    // version 2: the records of the event follow its header, so an event is read with one bounds check and skipped by moving Pos
+    BinaryPrimariesV2 V2;
+    size_t       EventPosition = 0;  // of the header of the current event
+    uint32_t     NumRecords    = 0;  // of the current event
+
+    static constexpr size_t RecordDataSize         = 8 * sizeof(double);
+    static constexpr size_t WeightedRecordDataSize = 9 * sizeof(double);
+
+    bool readHeader();                          // at Pos; false if there is no header
+    const char * findNameEnd(size_t dataSize);  // end of the particle name of the record at Pos, terminates the session if the record is truncated
+    static size_t getRecordDataSize(char marker) {return (marker == (char)0xFE ? WeightedRecordDataSize : RecordDataSize);}
+
+    void readV2Dictionary();
+    bool readV2EventHeader();                   // at Pos; false at the end of the file
+    size_t getV2EventSize();                    // bytes of the records of the current event, terminates the session if they are truncated
+};
+
+// Text formats: "#number" lines followed by one line per particle
+// G4ants: name energy x y z dx dy dz time [weight]
+// ANTS:   index energy x y z dx dy dz time [weight], index in the particle list of the config
+// The weight is optional (1 if omitted) and can be given only for some of the records
+class TextPrimariesReader : public StreamPrimariesReader
+{
+public:
+    TextPrimariesReader(const std::vector<G4ParticleDefinition*> * particleCollection = nullptr); // ANTS format if the collection is provided
+
+    bool open(const std::string & fileName) override;
+
+    void readEvent(std::vector<ParticleRecord> & primaries) override;
+    bool skipEvent() override;
+
+    long getPosition() override;
+    void setPosition(long position, const std::string & eventId, long lineNumber = -1) override;
+    long getLineNumber() const override {return LineNumber;}
+
+protected:
+    const std::vector<G4ParticleDefinition*> * ParticleCollection = nullptr;
+
+    // lines are parsed in place in the buffer, which is reused for the whole file
+    std::vector<char> Buffer;
+    size_t Begin        = 0;     // start of the unread data in the buffer
+    size_t End          = 0;     // end of the valid data in the buffer
+    long   BufferOffset = 0;     // position of Buffer[0] in the file
+    bool   bStreamEnd   = false;
+    long   LineNumber   = 0;     // of the last line returned by readLine, for the error messages
+    std::string ParticleName;
+
+    static constexpr size_t BufferSize = 1 << 20;
+
+    bool readLine(const char * & begin, const char * & end); // without the line break; false at the end of the file
+    void fillBuffer();
+    bool parseRecord(const char * p, const char * end, ParticleRecord & r, size_t index); // false if the line is malformed; index - of the record in the vector given to readEvent
+    void reportError(const std::string & message); // terminates the session
+};
+
+// Decodes the next events with another reader in a background thread, so file I/O and parsing overlap with tracking
+// Owns the wrapped reader; at most Depth decoded events are kept in the queue
+// The thread makes no Geant4 calls and does not end the session: new particle names and format errors are handled by the consuming thread
+class PrefetchingPrimariesReader : public PrimariesReader
+{
+public:
+    PrefetchingPrimariesReader(PrimariesReader * openedReader, int depth); // starts the thread
+    ~PrefetchingPrimariesReader();
+
+    bool open(const std::string & fileName) override; // reopens the wrapped reader
+
+    void readEvent(std::vector<ParticleRecord> & primaries) override;
+    bool skipEvent() override;                         // the events which are not decoded yet are skipped by the wrapped reader
+
+    long getPosition() override;
+    void setPosition(long position, const std::string & eventId, long lineNumber = -1) override;
+    long getLineNumber() const override;
+
+    bool isSeekable() const override {return S->Reader->isSeekable();}
+
+protected:
+    struct Batch
+    {
+        std::string EventId;
+        long        Position   = 0;   // position of the wrapped reader before the records of the event
+        long        LineNumber = 0;   // of the event header, see getLineNumber
+        std::vector<ParticleRecord> Primaries;
+        std::vector<std::pair<size_t, std::string>> UnresolvedNames;
+    };
+
+    // everything the thread uses: a thread blocked in reading a pipe is detached by the destructor and releases the state (and the wrapped reader) when it wakes up
+    struct State
+    {
+        ~State() {delete Reader;}
+
+        PrimariesReader * Reader = nullptr;
+        size_t Depth = 1;
+
+        mutable std::mutex      Mutex;
+        std::condition_variable Condition;
+        std::deque<Batch>       Queue;
+        std::vector<std::vector<ParticleRecord>> FreeBuffers; // returned by readEvent, reused by the thread
+        bool bFinished = false;           // the wrapped reader has no more events or has failed
+        std::string ErrorMessage;         // of the failure: reported by the consumer after the events decoded before it
+        std::string ErrorEventId;         // of the event which failed
+        bool bStop     = false;
+    };
+    std::shared_ptr<State> S;
+
+    std::thread Thread;                   // not running after skipEvent has used the wrapped reader directly, restarted by readEvent
+    std::vector<std::pair<size_t, std::string>> Unresolved; // of the last popped batch
+
+    void startThread();
+    void stopThread();
+    static void prefetch(std::shared_ptr<State> s); // thread function
+    void popBatch(std::vector<ParticleRecord> * primaries); // nullptr - only waits for the next event; updates NextEventId
+    bool dropBatch();                                       // discards the first decoded event, false if there is none
+};
+
+#endif // PrimariesReader_h
@@ -0,0 +1,45 @@
+#ifndef PrimariesV2Format_h
+#define PrimariesV2Format_h
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+
+// Version 2 of the G4ants binary format of the primaries (see BinaryPrimariesReader): file layout and the fixed-size record
+// The weight is a float (about 7 significant digits, up to ~3.4e38); use version 1 (double weight) if more is needed
+struct PrimariesV2Format
+{
+    static constexpr char Magic[8] = {'G','4','a','n','t','s','P','2'};
+
+    struct Record
+    {
+        int32_t  Particle;  // index in the names, WeightedFlag set if Weight is stored as is
+        float    Weight;    // without WeightedFlag: 0 stands for 1 (the field was reserved (0) in the files written before the weights)
+        double   Data[8];   // energy, x, y, z, dx, dy, dz, time
+
+        static constexpr int32_t WeightedFlag = 0x40000000; // so a weight of 0 can be stored
+
+        int32_t getParticleIndex() const {return Particle & ~WeightedFlag;} // negative if corrupted
+        double  getWeight() const {return ((Particle & WeightedFlag) || Weight != 0 ? Weight : 1.0);}
+        void    setWeight(double weight);                                   // weight 1 is stored as not weighted
+    };
+    static_assert(sizeof(Record) == 72, "Record has to be packed as in the file");
+
+    static constexpr uint32_t MaxNames = Record::WeightedFlag; // the indexes have to stay below the flag
+};
+
+// Writes a file in the version 2 format: the dictionary of the names first, then the events one by one
+// Errors are reported by the state of the stream
+class PrimariesV2Writer
+{
+public:
+    PrimariesV2Writer(std::ostream & stream, const std::vector<std::string> & names); // names: at most MaxNames, each shorter than 64 kB
+
+    void writeEvent(int32_t eventNumber, const std::vector<PrimariesV2Format::Record> & records);
+
+private:
+    std::ostream & Stream;
+};
+
+#endif // PrimariesV2Format_h
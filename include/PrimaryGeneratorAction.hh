@@ -3,9 +3,10 @@
 
 #include "G4VUserPrimaryGeneratorAction.hh"
 
-class G4ParticleGun;
 class G4Event;
 
+// The primaries are added to the event directly as G4PrimaryVertex / G4PrimaryParticle objects (no particle gun);
+// consecutive primaries with the same position and time share one vertex
 class PrimaryGeneratorAction : public G4VUserPrimaryGeneratorAction
 {
 public:
@@ -13,9 +14,6 @@ public:
     virtual ~PrimaryGeneratorAction();
 
     virtual void GeneratePrimaries(G4Event* );
-
-private:
-    G4ParticleGun * fParticleGun;
 };
 
 #endif // PrimaryGeneratorAction_h
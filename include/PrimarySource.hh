@@ -0,0 +1,100 @@
+#ifndef PrimarySource_h
+#define PrimarySource_h
+
+#include "PrimariesReader.hh"
+#include "AliasSampler.hh"
+#include "json11.hh"
+
+#include "G4ThreeVector.hh"
+#include "G4AffineTransform.hh"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+
+class G4ParticleDefinition;
+class G4VSolid;
+
+// Built-in source of primaries configured in the "PrimarySource" object of the config, used instead of a file with primaries
+// Every event is generated from its own random stream derived from (Seed, event index), so the events do not depend
+// on the threads, the shards or the order of reading; positions are event indexes, so checkpoints and event ranges work as for files
+class PrimarySource : public PrimariesReader
+{
+public:
+    PrimarySource(const json11::Json & json, uint64_t seed);
+
+    bool open(const std::string & fileName) override; // file name is ignored; resolves the particle and the volume (geometry has to be constructed)
+
+    void readEvent(std::vector<ParticleRecord> & primaries) override;
+    bool skipEvent() override;
+
+    long getPosition() override {return EventIndex;}
+    void setPosition(long position, const std::string & eventId, long lineNumber = -1) override;
+
+    void collectParticleNames(std::unordered_set<std::string> & names, size_t maxBytes) const override;
+
+    // SplitMix64, satisfies UniformRandomBitGenerator
+    struct Random
+    {
+        typedef uint64_t result_type;
+        uint64_t State;
+        explicit Random(uint64_t seed) : State(seed) {}
+        static constexpr uint64_t min() {return 0;}
+        static constexpr uint64_t max() {return UINT64_MAX;}
+        uint64_t operator()();
+        double uniform() {return ((*this)() >> 11) * 0x1.0p-53;} // [0, 1)
+    };
+
+private:
+    enum PositionShape {Point, Box, Cylinder, Volume};
+    enum DirectionMode {Isotropic, Cone, Beam};
+    enum EnergyMode    {Mono, Spectrum, Lines};
+
+    uint64_t Seed;
+    long     NumEvents = 0;
+    long     EventIndex = 0;
+
+    std::string ParticleName;
+    G4ParticleDefinition * Particle = nullptr;
+
+    double Multiplicity = 1;          // fixed number of primaries per event or the mean of the Poisson distribution
+    bool   bPoissonMultiplicity = false;
+    double Time = 0;                  // ns
+
+    PositionShape Shape = Point;
+    G4ThreeVector Center = {0, 0, 0}; // mm
+    G4ThreeVector Size   = {0, 0, 0}; // box: full size, mm
+    double Radius = 0;                // cylinder along z, mm
+    double Length = 0;
+    std::string VolumeName;           // name of the logical volume, it has to be placed once
+    const G4VSolid *  VolumeSolid = nullptr;
+    G4AffineTransform VolumeToGlobal;
+    G4ThreeVector VolumeMin, VolumeMax; // bounding box in the local frame of the volume
+    bool bIncludeDaughters = false;     // false - the points inside the daughters of the volume are rejected
+    std::vector<std::pair<const G4VSolid*, G4AffineTransform>> VolumeDaughters; // solid and the transform from the frame of the volume to the frame of the daughter
+
+    DirectionMode Direction = Isotropic;
+    G4ThreeVector Axis = {0, 0, 1};
+    G4ThreeVector AxisU, AxisV;       // complete Axis to an orthonormal basis
+    double CosHalfAngle = 1.0;
+
+    EnergyMode Energy = Mono;
+    double MonoEnergy = 0;                // keV
+    std::vector<double> EnergyPoints;     // spectrum: bin edges; lines: energies
+    std::vector<double> EnergyDensity;    // linear spectrum: density at the points
+    bool   bLinearSpectrum = false;       // false - uniform inside the bins
+    AliasSampler EnergySampler;           // of the bins / lines
+
+    void readPosition(const json11::Json & json);
+    void readDirection(const json11::Json & json);
+    void readEnergy(const json11::Json & json);
+    int  findVolume(const G4VPhysicalVolume * pv, const G4AffineTransform & toGlobal); // returns the number of placements of the logical volume VolumeName
+
+    G4ThreeVector generatePosition(Random & rnd) const;
+    bool          isInDaughter(const G4ThreeVector & local) const; // local - in the frame of the volume
+    G4ThreeVector generateDirection(Random & rnd) const;
+    double        generateEnergy(Random & rnd) const;
+};
+
+#endif // PrimarySource_h
@@ -28,7 +28,13 @@ public:
     virtual G4bool ProcessHits(G4Step* step, G4TouchableHistory* history);
 
     void readFromJson(const json11::Json & json);
-    void writeToJson(json11::Json::object & json);
+    void writeToJson(json11::Json::object & json, bool bRawEntries = false); // bRawEntries: the entries of the auto-range histograms are written instead of the content (for merging, see mergeFromJson)
+
+    MonitorSensitiveDetector * clone() const; // copy with the same settings and empty histograms, used by the MT workers
+    void configureFrom(const MonitorSensitiveDetector & other); // takes the settings of other, histograms are emptied
+    void merge(const MonitorSensitiveDetector & other);
+    void mergeFromJson(const json11::Json & json);     // json is in the format of writeToJson
+    void clearData();
 
     std::string Name;
     std::string ParticleName;
@@ -69,7 +75,10 @@ public:
     AHistogram2D * hPosition = nullptr;
 
 protected:
-    void writeHist1D(AHistogram1D *hist, json11::Json::object & json) const;
+    void writeHist1D(AHistogram1D *hist, json11::Json::object & json, bool bRawEntries) const;
+    void mergeHist1DFromJson(AHistogram1D * hist, const json11::Json & json);
+    void createHistograms();
+    void deleteHistograms();
 };
 
 #endif // SensitiveDetector_h
@@ -0,0 +1,53 @@
+#ifndef SESSIONCONTEXT_H
+#define SESSIONCONTEXT_H
+
+#include "SessionManager.hh"
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <unordered_set>
+
+class MonitorSensitiveDetector;
+
+// Runtime state of the simulation which is private to one thread (the only thread in sequential mode, a worker in MT mode)
+// SessionManager owns the contexts; use SessionManager::getContext() to obtain the one of the calling thread
+class SessionContext
+{
+public:
+    SessionContext(int threadId, SessionManager::HistoryMode collectHistory) :
+        ThreadId(threadId), CollectHistory(collectHistory) {}
+
+    int ThreadId = -1;
+
+    // current event
+    std::string EventId;                      // "#number"
+    long        EventIndex = -1;              // sequential index of the event (or sub-event) given to the threads, defines the output order; -1 - no event was assigned (end of input)
+    int         SubEventIndex = 0;            // > 0: continuation of an event split because of MaxPrimariesPerEvent
+    std::vector<ParticleRecord> Primaries;
+
+    int  NextTrackID = 1;
+    bool bStoppedOnMonitor = false;           // bug fix for Geant4? used in (Monitor)SensitiveDetector and SteppingAction
+
+    // per-event limits (see SessionManager::bEventLimits)
+    long   EventSteps    = 0;
+    int    EventTracks   = 0;
+    double EventCpuStart = 0;                 // thread CPU time at the start of the event, seconds
+    bool   bEventAborted = false;
+
+    SessionManager::HistoryMode CollectHistory = SessionManager::NotCollecting;
+
+    double DepoByRegistered = 0;
+    double DepoByNotRegistered = 0;
+    std::unordered_set<std::string> SeenNotRegisteredParticles;
+
+    // output of the current event; flushed to the files by SessionManager in the order of the events in the file with primaries
+    std::ostringstream DepoStream;
+    std::ostringstream HistoryStream;
+    std::ostringstream ExitStream;
+
+    // in MT mode: worker's copies of the monitors (same order as SessionManager::getMonitors()), merged at the end of the run
+    std::vector<MonitorSensitiveDetector*> Monitors; // does not own
+};
+
+#endif // SESSIONCONTEXT_H
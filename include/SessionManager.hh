@@ -6,7 +6,13 @@
 #include <string>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
 #include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ios>
 
 #include "G4ThreeVector.hh"
 
@@ -15,6 +21,9 @@ class G4StepPoint;
 class MonitorSensitiveDetector;
 class G4LogicalVolume;
 class G4VPhysicalVolume;
+class SessionContext;
+class PrimariesReader;
+class PrimariesIndex;
 
 struct ParticleRecord
 {
@@ -23,6 +32,7 @@ struct ParticleRecord
     G4ThreeVector Position  = {0, 0, 0};
     G4ThreeVector Direction = {0, 0, 0};
     G4double Time = 0;
+    G4double Weight = 1.0; // statistical weight, carried by the track and its secondaries
 };
 
 class SessionManager
@@ -40,32 +50,56 @@ class SessionManager
 
         void ReadConfig(const std::string & ConfigFileName);
 
+        void initializeRandomGenerator(); // has to be called before the run manager is created (MT: master engine is used to seed the workers)
         void startSession();
         void terminateSession(const std::string & ReturnMessage); //calls exit()!
+        static void throwOnTerminationInThisThread(); // terminateSession then throws std::runtime_error in the calling thread instead (reader thread: the error is reported by the consumer)
         void endSession();
 
         void runSimulation();
+        void setResume(bool flag) {bResume = flag;} // continue from the last checkpoint
+        void setEstimateMode(int numSampleEvents);  // simulate a random sample of events and report projected CPU time and output size; no output files
+        void setStageInput() {bStageInput = true;}  // primaries are the exit particles of the previous stage (see NextStage), has to be called before ReadConfig
 
-        void onRunFinished();
+        // server mode: after the first job the process waits for the next ones, keeping geometry and physics initialized
+        void configureServer(const std::string & fifoName, const std::string & configFileName);
+        bool isServerMode() const {return !ServerFifo.empty();}
+        void runServer(); // executes the jobs received through the fifo until "quit"
+
+        void buildInputIndex(); // writes the event index of the file with primaries (see PrimariesIndex)
+
+        SessionContext & getContext(); // runtime state of the calling thread
+
+        void onEventStarted();
+        void onEventFinished();
+        void abortEvent(const std::string & reason); // aborts the current event of the calling thread and logs its primaries; its output is discarded
+        static double getThreadCpuTime(); // seconds
+        void onRunFinished();  // master: merges the results collected by the thread contexts
         bool isGuiMode() const {return bGuiMode;}
+        int  getNumThreads() const {return NumThreads;}
+        bool isTaskBased() const {return bTasking;}
+        int  getTaskGrainSize() const {return TaskGrainSize;}
         const std::string & getGDML() const {return GDML;}
         const std::string & getPhysicsList() const {return PhysicsList;}
-        const std::string & getEventId() const {return EventId;}
-        void updateEventId();
-        std::vector<ParticleRecord> & getNextEventPrimaries();
-        bool isEndOfInputFileReached() const;
+        std::vector<ParticleRecord> & getNextEventPrimaries(); // thread-safe, fills the primaries and event id of the calling thread context
+        void seedEventRandomEngine(); // per-event seeding mode: seeds the engine of the calling thread from (Seed, event ID, sub-event)
+        long long getEventNumber(const std::string & eventId); // "#number" -> number, terminates the session if there is no number
+        bool isEndOfInputFileReached();
         const std::vector<std::string> & getListOfSensitiveVolumes() const {return SensitiveVolumes;}
         std::vector<MonitorSensitiveDetector*> & getMonitors() {return Monitors;}
         const std::map<std::string, double> & getStepLimitMap() const {return StepLimitMap;}
         int findParticle(const std::string & particleName);  // change to pointer search?
         int findMaterial(const std::string & materialName);  // change to pointer search?
+        G4ParticleDefinition * findGeant4Particle(const std::string & particleName); // terminates the session if not found
+        G4ParticleDefinition * findCachedGeant4Particle(const std::string & particleName); // only among the already resolved ones (no Geant4 calls), nullptr if not there
 
         bool activateNeutronThermalScatteringPhysics();
         void updateMaterials(G4VPhysicalVolume * worldPV);
 
         void writeNewEventMarker();
 
-        void saveDepoRecord(int iPart, int iMat, double edep, double * pos, double time);
+        // records of weighted tracks (weight != 1) get the weight as an additional last field, binary ones are marked with 0xFE instead of 0xFF
+        void saveDepoRecord(int iPart, int iMat, double edep, double * pos, double time, double weight = 1.0);
 
         void saveTrackStart(int trackID, int parentTrackID,
                             const G4String & particleName,
@@ -77,29 +111,25 @@ class SessionManager
                              const std::vector<int> *secondaries = nullptr,
                              int iMatTo = -1, const std::string &volNameTo = "", int volIndexTo = -1);
 
-        void resetPredictedTrackID() {NextTrackID = 1;}
-        void incrementPredictedTrackID() {NextTrackID++;}
-        int  getPredictedTrackID() {return NextTrackID;}
+        bool onTrackBuilt(); // returns false if MaxTracks is reached
 
         void findExitVolume();
 
-        void saveParticle(const G4String & particle, double energy, double time, double * PosDir);
+        void saveParticle(const G4String & particle, double energy, double time, double * PosDir, double weight = 1.0);
 
 public:
-        //runtime
+        //results merged from the thread contexts
         double DepoByRegistered = 0;
         double DepoByNotRegistered = 0;
 
         enum HistoryMode {NotCollecting, OnlyTracks, FullLog};
-        HistoryMode CollectHistory = NotCollecting;
-        int TracksToBuild = 0;
+        HistoryMode CollectHistory = NotCollecting; // configured mode; the runtime one is in SessionContext
+        std::atomic<int> TracksToBuild{0};
 
         int Precision    = 6;
 
         bool bMonitorsRequireSteppingAction = false;
 
-        bool bStoppedOnMonitor = false; // bug fix for Geant4? used in (Monitor)SensitiveDetector and SteppingAction
-
         bool bExitParticles = false;
         G4LogicalVolume * ExitVolume = nullptr;
         bool   bExitTimeWindow = false;
@@ -107,6 +137,12 @@ public:
         double ExitTimeTo = 1.0e6;
         bool   bExitKill = true;
 
+        // per-event watchdog, enforced in SteppingAction
+        bool   bEventLimits = false;
+        long   MaxStepsPerEvent   = 0;   // 0 - no limit
+        int    MaxTracksPerEvent  = 0;
+        double MaxCpuTimePerEvent = 0;   // seconds
+
 private:
         void prepareParticleCollection();
         void prepareMonitors();
@@ -114,11 +150,61 @@ private:
         void prepareOutputDepoStream();
         void prepareOutputHistoryStream();
         void prepareOutputExitStream();
+        void prepareOutputAbortedStream();
+        void runNextStage(); // the session fails if the next stage fails
         void executeAdditionalCommands();
+        void prepareContexts();
+        void closeStreams();
+
+        void prepareEstimate();
+        void reportEstimate();
+
+        void writeCheckpoint();
+        void readCheckpoint();
+        std::ios::openmode resumeOutputFile(const std::string & fileName, const std::string & sizeKey);
         void generateReceipt();
         void storeMonitorsData();
 
-        G4ParticleDefinition * findGeant4Particle(const std::string & particleName);
+        void flushEventOutput(SessionContext & C);
+
+        bool isInputExhausted() const;
+        long countEventsInInput(); // from the current position, within the configured event range
+        void skipEvents(long num);  // uses the index if available
+        void recyclePrimaries(const std::string & eventId, const std::vector<ParticleRecord> & primaries); // fills SplitPrimaries with the transformed copies
+        PrimariesReader * openPrimariesReader();
+
+        void seedEngineStream(uint64_t stream); // independent stream of the selected engine
+
+        void runShardedSimulation();
+        void runShard(int iShard, long firstEvent, long numEvents);
+        std::string makeShardFileName(const std::string & fileName, int iShard) const;
+        void mergeShards(int numShards);
+        void appendShardFile(std::ofstream * out, const std::string & fileName);
+
+        struct ServerSetup // configuration fixed for the lifetime of the process: a server job with a different one restarts the process
+        {
+            std::string GDML;
+            long        GDMLModified = 0;
+            std::string PhysicsList;
+            std::string RandomEngine;
+            bool        bThermalScattering = false;
+            int         NumThreads = 1;
+            bool        bTasking = false;
+            int         TaskGrainSize = 0;
+            std::vector<std::string> SensitiveVolumes;
+            std::map<std::string, double> StepLimitMap;
+            std::vector<std::pair<std::string, std::string>> MaterialsToOverrideWithStandard;
+            std::vector<std::string> MonitorNames;
+            bool        bSteppingAction = false;
+            bool        bTrackingAction = false;
+
+            bool covers(const ServerSetup & job) const;
+        };
+        ServerSetup makeServerSetup() const;
+        bool readServerJob(std::string & configFileName);
+        void runServerJob(const std::string & configFileName);
+        void restartServer(const std::string & configFileName, bool bIdle); // returns only on failure
+
         bool extractIonInfo(const std::string & text, int & Z, int & A, double & E);
 
     private:
@@ -128,8 +214,43 @@ private:
         std::string FileName_Receipt;
         std::string FileName_Tracks;
         long Seed = 0;
-        std::string EventId; //  "#number"
-        std::string NextEventId;
+        std::string RandomEngineName = "Ranecu";
+        static constexpr uint64_t RanecuSeedTableSize = 215; // CLHEP HepRandom seed table
+        bool bPerEventSeeding = false;
+        int  NumThreads = 1;
+        bool bTasking = false;
+        int  TaskGrainSize = 0;
+        static constexpr int DefaultEventsPerTaskRun = 100000;
+        int  NumProcesses = 1;
+        int  ShardIndex = -1;               // >= 0 in the forked worker processes
+        long MaxEventsToRead = -1;          // -1 - until the end of the file
+        int  MaxPrimariesPerEvent = 0;      // > 0: larger events are split into sub-events
+        int  RecycleTimes = 1;              // > 1: phase-space recycling, every event is simulated this many times as sub-events, with the weights divided by it;
+                                            //      the sub-events are always seeded per event (as with bPerEventSeeding)
+        bool bRecycleRotate = true;         // copies are rotated about RecycleAxis through RecycleCenter by a random angle
+        bool bRecycleMirror = false;        // and reflected in the plane through RecycleCenter normal to the axis with probability 1/2
+        G4ThreeVector RecycleAxis   = {0, 0, 1};
+        G4ThreeVector RecycleCenter = {0, 0, 0};
+        double MaxWallTime = 0;             // seconds, 0 - no limit
+        std::chrono::steady_clock::time_point SessionStartTime;
+        bool bStoppedByWallTime = false;
+        bool bCheckpoint = false;
+        int  CheckpointEvents = 0;          // events per run, the checkpoint is written after every run
+        std::string FileName_Checkpoint;
+        bool bResume = false;
+        json11::Json ResumeCheckpoint;
+
+        // estimate mode
+        int  EstimateEvents = 0;            // size of the sample, 0 - normal mode
+        long EstimateTotalEvents = 0;
+        std::vector<long> SampleEvents;     // sorted indexes of the events to simulate
+        size_t NextSampleEvent = 0;
+        double EstimateCpuStart = 0;
+        std::chrono::steady_clock::time_point EstimateWallStart;
+        json11::Json EstimateReport;
+        long DepositionBytes = 0;           // written to the output streams in this session
+        long HistoryBytes    = 0;
+        long ExitBytes       = 0;
         std::string GDML;
         std::string PhysicsList;
         bool        bUseThermalScatteringNeutronPhysics = false;
@@ -143,30 +264,81 @@ private:
         std::map<std::string, double> StepLimitMap;
         bool bG4antsPrimaries = false;
         bool bBinaryPrimaries = false;
-        std::ifstream * inStreamPrimaries   = nullptr;
+        bool bPrimarySource = false;
+        json11::Json PrimarySourceConfig;
+        int  PrefetchEvents = 8;         // events decoded ahead by the reader thread; 0 - the input is read synchronously
+        long FirstEventToRead = 0;
+        long NumEventsToRead  = -1;      // -1 - until the end of the file
+        PrimariesReader * inPrimaries       = nullptr;
+        PrimariesIndex  * inIndex           = nullptr;
+        static constexpr size_t ParticleNameScanBytes = 64 << 20; // beginning of the binary file with primaries scanned for the particle names to pre-resolve
         std::ofstream * outStreamDeposition = nullptr;
         std::ofstream * outStreamHistory    = nullptr;
         std::ofstream * outStreamExit       = nullptr;
-        std::vector<ParticleRecord> GeneratedPrimaries;
+        std::ofstream * outStreamAborted    = nullptr;
         bool bGuiMode = false;
 
         bool bExitBinary = false;
         bool bBinaryOutput = false;
 
+        // two-stage simulation: the exit particles are the primaries of the next stage, a G4ants process started with the NextStage config
+        // they are passed through its standard input; without the exit file they are kept in memory until the end of this stage
+        std::string NextStageConfig;
+        bool        bExitToMemory = false;
+        std::string ExitBuffer;
+        bool        bStageInput = false;
+
         std::vector<MonitorSensitiveDetector*> Monitors; //can contain nullptr!
+        std::vector<std::string> MonitorNames;
 
         std::string FileName_Exit;
+        std::string FileName_Aborted;   // primaries of the events aborted by the watchdog, in the format of the G4ants text primaries
+        int EventsAborted = 0;
         std::string ExitVolumeName;
 
         int EventsDone = 0;
         int NumEventsToDo = 0;
         double ProgressLastReported = 0;
         double ProgressInc = 1.0;
-
-        int NextTrackID = 1;
+        bool   bReportProgress = true;
 
         std::unordered_set<std::string> SeenNotRegisteredParticles;
 
+        // multithreading
+        std::vector<SessionContext*> Contexts;
+        std::mutex ContextMutex;
+        std::mutex InputMutex;
+        std::mutex OutputMutex;
+        std::mutex ParticleCacheMutex;
+
+        std::unordered_map<std::string, G4ParticleDefinition*> ParticleCache; // findGeant4Particle: exact name as in the primaries -> definition
+
+        struct EventOutput
+        {
+            bool        bNewEvent = true;  // false for the continuation sub-events
+            std::string Deposition;
+            std::string History;
+            std::string Exit;
+        };
+        long EventsRead       = 0;        // events read from the file with primaries
+        long EventsHandedOut  = 0;        // events (and sub-events) given to the threads, defines the output order
+        std::vector<ParticleRecord> SplitPrimaries; // remaining primaries of the oversized event being split
+        std::string SplitEventId;
+        size_t SplitNextPrimary  = 0;
+        size_t SplitSize         = 0;      // primaries per sub-event
+        size_t SplitCopySize     = 0;      // recycling: primaries per copy, the sub-events do not cross the copies
+        int    SplitNextSubEvent = 0;
+        long NextEventToWrite = 0;
+        std::map<long, EventOutput> PendingOutput; // finished events waiting for the preceding ones to be written
+        void writeEventOutput(const EventOutput & out);
+
+        // server mode
+        std::string ServerFifo;
+        std::string ServerConfigFile;   // last config compatible with the running setup, used to restart after a failed job
+        int         ServerFd = -1;
+        bool        bServerReady = false; // the first job is done: a failed job restarts the server instead of terminating it
+        ServerSetup RunningSetup;
+
         //to report back to ants2
         bool bError;
         std::string ErrorMessage;
@@ -10,12 +10,16 @@ class AHistogram1D
 {
 public:
     AHistogram1D(int Bins, double From, double To);
-    void setBufferSize(size_t size) {bufferSize = size;}
+    void setBufferSize(size_t size) {bufferSize = size;} // auto range (To <= From): it is chosen from the first size entries; 0 - from all entries, when the content is requested
 
     void Fill(double x, double val = 1.0);
+    void merge(const AHistogram1D & other); // exact if the ranges are the same, otherwise other is re-binned using the bin centers
+    void setContent(const std::vector<double> & content, const std::vector<double> & stat); // format of getContent() and getStat()
 
     void getLimits(double & From, double & To) const {From = from; To = to;}
     int  getBins() const {return bins;}
+    bool isRangeFixed() const {return bFixedRange;}
+    const std::vector<std::pair<double, double>> & getBuffer() const {return buffer;} // entries (x, val) waiting for the range
     const std::vector<double> & getContent(); // [0] - underflow, [1] - bin#0, ..., [bins] - bin#(bins-1), [bins+1] - overflow
     const std::vector<double> getStat() const;    // [0] - sumVals, [1] - sumVals2, [2] - sumValX, [3] - sumValX2, [4] - # entries
 
@@ -39,6 +43,7 @@ private:
 
 private:
     void fillFixed(double x, double val);
+    void addToBin(double x, double val);
     void processBuffer();
 
 };
@@ -47,11 +52,15 @@ class AHistogram2D
 {
 public:
     AHistogram2D(int XBins, double XFrom, double XTo, int YBins, double YFrom, double YTo);
-    void setBufferSize(size_t size) {bufferSize = size;}
+    void setBufferSize(size_t size) {bufferSize = size;} // see AHistogram1D
 
     void Fill(double x, double y, double val = 1.0);
+    void merge(const AHistogram2D & other); // exact if the ranges are the same, otherwise other is re-binned using the bin centers
+    void setContent(const std::vector< std::vector<double> > & content, const std::vector<double> & stat); // format of getContent() and getStat()
 
     void getLimits(double & Xfrom, double & Xto, double & Yfrom, double & Yto) const {Xfrom = xfrom; Xto = xto; Yfrom = yfrom; Yto = yto;}
+    bool isRangeFixed() const {return bFixedRange;}
+    const std::vector<std::tuple<double, double, double>> & getBuffer() const {return buffer;} // entries (x, y, val) waiting for the range
     const std::vector< std::vector<double> > & getContent(); //[y][x]; in each X: [0] - underflow, [1] - bin#0, ..., [bins] - bin#(bins-1), [bins+1] - overflow
     const std::vector<double> getStat();    // [0] - sumVals, [1] - sumVals2, [2] - sumValX, [3] - sumValX2, [4] - sumValY, [5] - sumValY2, [6] - # entries
 
@@ -82,6 +91,7 @@ private:
 
 private:
     void fillFixed(double x, double y, double val);
+    void addToBin(double x, double y, double val);
     void processBuffer();
 
 };
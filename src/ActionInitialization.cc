@@ -2,7 +2,7 @@
 #include "SessionManager.hh"
 #include "PrimaryGeneratorAction.hh"
 #include "RunAction.hh"
-//#include "EventAction.hh"
+#include "EventAction.hh"
 #include "TrackingAction.hh"
 #include "SteppingAction.hh"
 //#include "StackingAction.hh"
@@ -12,17 +12,22 @@ ActionInitialization::ActionInitialization()
 
 ActionInitialization::~ActionInitialization() {}
 
+void ActionInitialization::BuildForMaster() const
+{
+    SetUserAction(new RunAction);
+}
+
 void ActionInitialization::Build() const
 {
     SetUserAction(new PrimaryGeneratorAction);
 
     SetUserAction(new RunAction);
 
-    //SetUserAction(new EventAction);
+    SetUserAction(new EventAction);
     //SetUserAction(new StackingAction);
 
     SessionManager & SM = SessionManager::getInstance();
-    if (SM.CollectHistory != SessionManager::NotCollecting || SM.bMonitorsRequireSteppingAction || SM.bExitParticles)
+    if (SM.CollectHistory != SessionManager::NotCollecting || SM.bMonitorsRequireSteppingAction || SM.bExitParticles || SM.bEventLimits)
         SetUserAction(new SteppingAction);
 
     if (SM.CollectHistory != SessionManager::NotCollecting)
@@ -0,0 +1,52 @@
+#include "AliasSampler.hh"
+
+bool AliasSampler::build(const std::vector<double> & weights)
+{
+    const size_t n = weights.size();
+    Probability.clear();
+    Alias.clear();
+
+    double sum = 0;
+    for (double w : weights)
+    {
+        if (w < 0) return false;
+        sum += w;
+    }
+    if (n == 0 || sum <= 0) return false;
+
+    Probability.resize(n);
+    Alias.resize(n);
+
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; i++)
+    {
+        scaled[i] = weights[i] * n / sum;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+
+    while (!small.empty() && !large.empty())
+    {
+        const uint32_t s = small.back(); small.pop_back();
+        const uint32_t l = large.back(); large.pop_back();
+
+        Probability[s] = scaled[s];
+        Alias[s] = l;
+
+        scaled[l] -= (1.0 - scaled[s]);
+        (scaled[l] < 1.0 ? small : large).push_back(l);
+    }
+
+    // the rest is 1 up to the rounding errors
+    for (uint32_t i : large) {Probability[i] = 1.0; Alias[i] = i;}
+    for (uint32_t i : small) {Probability[i] = 1.0; Alias[i] = i;}
+    return true;
+}
+
+size_t AliasSampler::sample(double u) const
+{
+    const double x = u * Probability.size();
+    size_t column = (size_t)x;
+    if (column >= Probability.size()) column = Probability.size() - 1;
+    return ((x - column) < Probability[column] ? column : Alias[column]);
+}
@@ -1,11 +1,13 @@
 #include "DetectorConstruction.hh"
 #include "SensitiveDetector.hh"
 #include "SessionManager.hh"
+#include "SessionContext.hh"
 
 #include "G4SDManager.hh"
 #include "G4LogicalVolumeStore.hh"
 #include "G4SystemOfUnits.hh"
 #include "G4UserLimits.hh"
+#include "G4Threading.hh"
 
 DetectorConstruction::DetectorConstruction(G4VPhysicalVolume *setWorld)
     : G4VUserDetectorConstruction(), fWorld(setWorld) {}
@@ -56,8 +58,17 @@ void DetectorConstruction::ConstructSDandField()
     }
 
     // ---- Monitors ----
+    // MT: every worker fills its own copies, they are merged by SessionManager::onRunFinished()
+    const bool bWorker = !G4Threading::IsMasterThread();
     for (MonitorSensitiveDetector * mon : SM.getMonitors())
+    {
+        if (bWorker)
+        {
+            mon = mon->clone();
+            SM.getContext().Monitors.push_back(mon);
+        }
         SetSensitiveDetector(mon->Name, mon);
+    }
 }
 
 bool DetectorConstruction::isAccordingTo(const std::string &name, const std::string & wildcard) const
@@ -1,10 +1,26 @@
 #include "EventAction.hh"
+#include "SessionManager.hh"
+
+#include "G4Event.hh"
+#include "G4RunManager.hh"
 
 EventAction::EventAction()
 : G4UserEventAction() {}
 
 EventAction::~EventAction() {}
 
-void EventAction::BeginOfEventAction(const G4Event*) {}
+void EventAction::BeginOfEventAction(const G4Event*)
+{
+    SessionManager & SM = SessionManager::getInstance();
+    SM.onEventStarted();
+}
+
+void EventAction::EndOfEventAction(const G4Event*)
+{
+    SessionManager & SM = SessionManager::getInstance();
+    SM.onEventFinished();
 
-void EventAction::EndOfEventAction(const G4Event*) {}
+    // the run was started for "infinite" number of events: stop it after the last event in the file
+    if (SM.isEndOfInputFileReached())
+        G4RunManager::GetRunManager()->AbortRun(true); // soft abort: the current event is already completed
+}
@@ -0,0 +1,79 @@
+#include "GzipStreamBuf.hh"
+
+#include <fstream>
+#include <sys/stat.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+
+GzipStreamBuf::~GzipStreamBuf()
+{
+    if (File) gzclose(File);
+}
+
+bool GzipStreamBuf::open(const std::string & fileName)
+{
+    File = gzopen(fileName.data(), "rb");
+    if (!File) return false;
+
+    gzbuffer(File, 1 << 18);
+    Buffer.resize(1 << 18);
+    setg(Buffer.data(), Buffer.data(), Buffer.data());
+    return true;
+}
+
+GzipStreamBuf::int_type GzipStreamBuf::underflow()
+{
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+    const int numRead = gzread(File, Buffer.data(), Buffer.size());
+    if (numRead <= 0) return traits_type::eof();
+
+    setg(Buffer.data(), Buffer.data(), Buffer.data() + numRead);
+    return traits_type::to_int_type(*gptr());
+}
+
+GzipStreamBuf::pos_type GzipStreamBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    if (!File || !(which & std::ios_base::in) || dir == std::ios_base::end) return pos_type(off_type(-1));
+
+    const off_type current = gztell(File) - (egptr() - gptr());
+    if (dir == std::ios_base::cur)
+    {
+        if (off == 0) return pos_type(current); // tellg
+        off += current;
+    }
+    return seekpos(pos_type(off), which);
+}
+
+GzipStreamBuf::pos_type GzipStreamBuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+    if (!File || !(which & std::ios_base::in)) return pos_type(off_type(-1));
+
+    if (gzseek(File, (z_off_t)pos, SEEK_SET) < 0) return pos_type(off_type(-1));
+    setg(Buffer.data(), Buffer.data(), Buffer.data());
+    return pos;
+}
+
+#else
+
+GzipStreamBuf::~GzipStreamBuf() {}
+bool GzipStreamBuf::open(const std::string &) {return false;}
+GzipStreamBuf::int_type GzipStreamBuf::underflow() {return traits_type::eof();}
+GzipStreamBuf::pos_type GzipStreamBuf::seekoff(off_type, std::ios_base::seekdir, std::ios_base::openmode) {return pos_type(off_type(-1));}
+GzipStreamBuf::pos_type GzipStreamBuf::seekpos(pos_type, std::ios_base::openmode) {return pos_type(off_type(-1));}
+
+#endif
+
+bool GzipStreamBuf::isGzipFile(const std::string & fileName)
+{
+    // pipes cannot be peeked: only the extension is checked
+    struct stat st;
+    if (stat(fileName.data(), &st) != 0 || !S_ISREG(st.st_mode))
+        return fileName.size() > 3 && fileName.compare(fileName.size() - 3, 3, ".gz") == 0;
+
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    unsigned char magic[2] = {0, 0};
+    in.read((char*)magic, 2);
+    return in.gcount() == 2 && magic[0] == 0x1F && magic[1] == 0x8B;
+}
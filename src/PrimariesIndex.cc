@@ -0,0 +1,111 @@
+#include "PrimariesIndex.hh"
+#include "PrimariesReader.hh"
+#include "SessionManager.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+bool PrimariesIndex::readFileStamp(const std::string & fileName, Header & h)
+{
+    struct stat st;
+    if (stat(fileName.data(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+    h.FileSize = st.st_size;
+    h.FileTime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+long PrimariesIndex::build(PrimariesReader & reader, const std::string & primariesFileName)
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    Header h;
+    if (!readFileStamp(primariesFileName, h)) SM.terminateSession("Only regular files with primaries can be indexed");
+
+    const std::string fileName = makeFileName(primariesFileName);
+    const std::string tmpName  = fileName + ".tmp";
+    std::ofstream out(tmpName, std::ios::out | std::ios::binary);
+    if (!out.is_open()) SM.terminateSession("Cannot open index file " + tmpName);
+    out.write((char*)&h, sizeof(Header)); // the number of events is updated at the end
+
+    // the event headers go to a separate file, appended after the entries
+    const std::string idsName = fileName + ".ids.tmp";
+    std::fstream ids(idsName, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!ids.is_open()) SM.terminateSession("Cannot open temporary file " + idsName);
+
+    while (!reader.isExhausted())
+    {
+        const std::string & id = reader.NextEventId;
+        Entry e;
+        e.Position   = reader.getPosition();
+        e.LineNumber = reader.getLineNumber();
+        e.IdOffset   = ids.tellp();
+        e.IdSize     = id.size();
+        out.write((char*)&e, sizeof(Entry));
+        ids.write(id.data(), id.size());
+
+        h.NumEvents++;
+        reader.skipEvent();
+    }
+
+    ids.seekg(0);
+    if (h.NumEvents > 0) out << ids.rdbuf();
+    ids.close();
+    std::remove(idsName.data());
+
+    out.seekp(0);
+    out.write((char*)&h, sizeof(Header));
+    out.close();
+    if (out.fail() || std::rename(tmpName.data(), fileName.data()) != 0)
+        SM.terminateSession("Failed to write index file " + fileName);
+
+    return h.NumEvents;
+}
+
+bool PrimariesIndex::open(const std::string & primariesFileName)
+{
+    Stream.open(makeFileName(primariesFileName), std::ios::in | std::ios::binary);
+    if (!Stream.is_open()) return false;
+
+    Header h, stamp;
+    Stream.read((char*)&h, sizeof(Header));
+    if (Stream.fail() || std::memcmp(h.Magic, stamp.Magic, sizeof(h.Magic)) != 0) return false;
+    if (!readFileStamp(primariesFileName, stamp)) return false;
+    if (h.FileSize != stamp.FileSize || h.FileTime != stamp.FileTime) return false; // stale
+
+    NumEvents = h.NumEvents;
+    return true;
+}
+
+PrimariesIndex::Entry PrimariesIndex::getEntry(long iEvent)
+{
+    Entry e;
+    Stream.clear();
+    Stream.seekg(sizeof(Header) + iEvent * sizeof(Entry));
+    Stream.read((char*)&e, sizeof(Entry));
+    return e;
+}
+
+std::string PrimariesIndex::getEventId(const Entry & e)
+{
+    std::string id(e.IdSize, '\0');
+    Stream.clear();
+    Stream.seekg(sizeof(Header) + NumEvents * sizeof(Entry) + e.IdOffset);
+    Stream.read(&id[0], e.IdSize);
+    return id;
+}
+
+long PrimariesIndex::findEvent(long position)
+{
+    // the entries are ordered by position
+    long from = 0, to = NumEvents;
+    while (from < to)
+    {
+        const long mid = from + (to - from) / 2;
+        if ((long)getEntry(mid).Position < position) from = mid + 1;
+        else to = mid;
+    }
+    if (from < NumEvents && (long)getEntry(from).Position == position) return from;
+    return -1;
+}
@@ -0,0 +1,949 @@
+#include "PrimariesReader.hh"
+#include "GzipStreamBuf.hh"
+
+#include <cstring>
+#include <algorithm>
+#include <charconv>
+#include <limits>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+G4ParticleDefinition * PrimariesReader::findParticle(const std::string & name, size_t index)
+{
+    SessionManager & SM = SessionManager::getInstance();
+    if (!UnresolvedNames) return SM.findGeant4Particle(name); // terminates session if not found
+
+    G4ParticleDefinition * particle = SM.findCachedGeant4Particle(name);
+    if (!particle) UnresolvedNames->emplace_back(index, name);
+    return particle;
+}
+
+// ---- stream input ----
+
+bool StreamPrimariesReader::openStream(const std::string & fileName)
+{
+    struct stat st;
+    bPipe = (stat(fileName.data(), &st) == 0 && !S_ISREG(st.st_mode));
+
+    if (GzipStreamBuf::isGzipFile(fileName))
+    {
+#ifndef WITH_ZLIB
+        SessionManager::getInstance().terminateSession("The file with primaries is compressed, but G4ants was built without zlib");
+#endif
+        GzipStreamBuf * buf = new GzipStreamBuf();
+        Decompressor.reset(buf);
+        if (!buf->open(fileName)) return false;
+        Stream.rdbuf(buf);
+    }
+    else
+    {
+        File.open(fileName, std::ios::in | std::ios::binary);
+        if (!File.is_open()) return false;
+        Stream.rdbuf(File.rdbuf());
+    }
+    return true;
+}
+
+// ---- G4ants binary version 2, common part ----
+
+void BinaryPrimariesV2::setNames(std::vector<std::string> && names)
+{
+    Names = std::move(names);
+    Particles.assign(Names.size(), nullptr);
+}
+
+void BinaryPrimariesV2::decode(const char * data, uint32_t numRecords, std::vector<ParticleRecord> & primaries, PrimariesReader & reader)
+{
+    const size_t first = primaries.size();
+    primaries.resize(first + numRecords);
+    for (uint32_t i = 0; i < numRecords; i++)
+    {
+        Record rec;
+        std::memcpy(&rec, data + i * sizeof(Record), sizeof(Record));
+        const int32_t index = rec.getParticleIndex();
+        if (index < 0 || index >= (int32_t)Names.size())
+            SessionManager::getInstance().terminateSession("Unknown particle index in the binary file with primaries");
+
+        G4ParticleDefinition * & particle = Particles[index];
+        if (!particle) particle = reader.findParticle(Names[index], first + i);
+
+        ParticleRecord & r = primaries[first + i];
+        r.Particle  = particle;
+        r.Energy    = rec.Data[0];
+        r.Position  = {rec.Data[1], rec.Data[2], rec.Data[3]};
+        r.Direction = {rec.Data[4], rec.Data[5], rec.Data[6]};
+        r.Time      = rec.Data[7];
+        r.Weight    = rec.getWeight();
+    }
+}
+
+// ---- G4ants binary, read from the stream ----
+
+bool BinaryPrimariesReader::open(const std::string & fileName)
+{
+    if (!openStream(fileName)) return false;
+
+    NextEventId.clear();
+    Version = (Stream.peek() == BinaryPrimariesV2::Magic[0] ? 2 : 1); // peek: works also for pipes
+    if (Version == 2)
+    {
+        readV2Dictionary();
+        readV2EventHeader();
+        return true;
+    }
+
+    int eventId;
+    char ch = (char)0x00;
+    Stream.get(ch);
+    if (ch == (char)0xEE)
+    {
+        Stream.read((char*)&eventId, sizeof(int));
+        NextEventId = '#' + std::to_string(eventId);
+    }
+
+    if (ch != (char)0xEE || Stream.fail())
+        SessionManager::getInstance().terminateSession("Unexpected format of the binary file with primaries");
+    return true;
+}
+
+void BinaryPrimariesReader::readV2Dictionary()
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    char magic[8];
+    uint32_t numNames = 0;
+    Stream.read(magic, sizeof(magic));
+    Stream.read((char*)&numNames, sizeof(numNames));
+    if (Stream.fail() || std::memcmp(magic, BinaryPrimariesV2::Magic, sizeof(magic)) != 0)
+        SM.terminateSession("Unexpected format of the binary file with primaries");
+
+    std::vector<std::string> names;
+    for (uint32_t i = 0; i < numNames; i++)
+    {
+        uint16_t length = 0;
+        Stream.read((char*)&length, sizeof(length));
+        std::string name(length, '\0');
+        Stream.read(&name[0], length);
+        if (Stream.fail()) SM.terminateSession("Unexpected end of the binary file with primaries");
+        names.push_back(std::move(name));
+    }
+    V2.setNames(std::move(names));
+}
+
+void BinaryPrimariesReader::collectParticleNames(std::unordered_set<std::string> & names, size_t) const
+{
+    names.insert(V2.getNames().begin(), V2.getNames().end());
+}
+
+bool BinaryPrimariesReader::readV2EventHeader()
+{
+    NextEventId.clear();
+    EventPosition = (long)Stream.tellg();
+
+    int32_t eventId;
+    Stream.read((char*)&eventId, sizeof(eventId));
+    Stream.read((char*)&NumRecords, sizeof(NumRecords));
+    if (Stream.fail()) return false;
+
+    NextEventId = '#' + std::to_string(eventId);
+    return true;
+}
+
+void BinaryPrimariesReader::readEvent(std::vector<ParticleRecord> & primaries)
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    if (Version == 2)
+    {
+        // in chunks: the buffer grows only as far as the file really provides the records
+        for (uint32_t done = 0; done < NumRecords; )
+        {
+            const uint32_t num = std::min(NumRecords - done, MaxChunkRecords);
+            Records.resize(num * sizeof(BinaryPrimariesV2::Record));
+            Stream.read(Records.data(), Records.size());
+            if (Stream.fail()) SM.terminateSession("Unexpected end of the binary file with primaries");
+
+            V2.decode(Records.data(), num, primaries, *this);
+            done += num;
+        }
+
+        readV2EventHeader();
+        return;
+    }
+
+    NextEventId.clear();
+
+    int eventId;
+    std::string pn;
+    char ch;
+    while (Stream.get(ch))
+    {
+        if (ch == (char)0xEE)
+        {
+            Stream.read((char*)&eventId, sizeof(int));
+            if (Stream.fail()) SM.terminateSession("Unexpected end of the binary file with primaries");
+            NextEventId = '#' + std::to_string(eventId);
+            break; //event finished
+        }
+        else if (ch == (char)0xFF || ch == (char)0xFE)
+        {
+            const bool bWeighted = (ch == (char)0xFE);
+            pn.clear();
+            while (Stream.get(ch))
+            {
+                if (ch == (char)0x00) break;
+                pn += ch;
+            }
+            if (Stream.fail()) SM.terminateSession("Unexpected end of the binary file with primaries");
+
+            ParticleRecord r;
+            r.Particle = findParticle(pn, primaries.size());
+            Stream.read((char*)&r.Energy,       sizeof(double));
+            Stream.read((char*)&r.Position[0],  sizeof(double));
+            Stream.read((char*)&r.Position[1],  sizeof(double));
+            Stream.read((char*)&r.Position[2],  sizeof(double));
+            Stream.read((char*)&r.Direction[0], sizeof(double));
+            Stream.read((char*)&r.Direction[1], sizeof(double));
+            Stream.read((char*)&r.Direction[2], sizeof(double));
+            Stream.read((char*)&r.Time,         sizeof(double));
+            if (bWeighted) Stream.read((char*)&r.Weight, sizeof(double));
+            // a writer which died in the middle of the record (pipe) would otherwise give a garbage primary
+            if (Stream.fail()) SM.terminateSession("Unexpected end of the binary file with primaries");
+
+            primaries.push_back(r);
+        }
+    }
+}
+
+bool BinaryPrimariesReader::skipEvent()
+{
+    if (Version == 2)
+    {
+        // fixed-size records: the event is skipped without reading it (pipes can only be read through)
+        const std::streamoff size = (std::streamoff)NumRecords * sizeof(BinaryPrimariesV2::Record);
+        if (!Stream.seekg(size, std::ios::cur))
+        {
+            Stream.clear();
+            Stream.ignore(size);
+        }
+        return readV2EventHeader();
+    }
+
+    NextEventId.clear();
+
+    char ch;
+    while (Stream.get(ch))
+    {
+        if (ch == (char)0xEE)
+        {
+            int eventId;
+            Stream.read((char*)&eventId, sizeof(int));
+            NextEventId = '#' + std::to_string(eventId);
+            return true;
+        }
+        else if (ch == (char)0xFF || ch == (char)0xFE)
+        {
+            Stream.ignore(std::numeric_limits<std::streamsize>::max(), 0x00); // particle name
+            Stream.ignore((ch == (char)0xFE ? 9 : 8) * sizeof(double));
+        }
+    }
+    return false;
+}
+
+long BinaryPrimariesReader::getPosition()
+{
+    if (Version == 2) return EventPosition; // the record count is in the header
+    return (long)Stream.tellg();
+}
+
+void BinaryPrimariesReader::setPosition(long position, const std::string & eventId, long)
+{
+    Stream.clear();
+    Stream.seekg(position);
+    if (Version == 2) readV2EventHeader();
+    else NextEventId = eventId;
+}
+
+// ---- G4ants binary, memory-mapped ----
+
+MappedBinaryPrimariesReader::~MappedBinaryPrimariesReader()
+{
+    if (Data) munmap((void*)Data, Size);
+}
+
+bool MappedBinaryPrimariesReader::open(const std::string & fileName)
+{
+    // checked before opening: opening a FIFO unblocks its writer, which gets SIGPIPE if it writes before the stream reader reopens the FIFO
+    struct stat st;
+    if (stat(fileName.data(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+    if (GzipStreamBuf::isGzipFile(fileName)) return false;
+
+    const int fd = ::open(fileName.data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+
+    Size = st.st_size;
+    if (Size > 0)
+    {
+        void * p = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        madvise(p, Size, MADV_SEQUENTIAL);
+        Data = (const char*)p;
+    }
+    close(fd); // the mapping stays valid
+
+    Pos = 0;
+    Version = (Size > 0 && Data[0] == BinaryPrimariesV2::Magic[0] ? 2 : 1);
+    if (Version == 2)
+    {
+        readV2Dictionary();
+        readV2EventHeader();
+        return true;
+    }
+
+    if (!readHeader())
+        SessionManager::getInstance().terminateSession("Unexpected format of the binary file with primaries");
+    return true;
+}
+
+void MappedBinaryPrimariesReader::readV2Dictionary()
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    uint32_t numNames = 0;
+    if (Size < sizeof(BinaryPrimariesV2::Magic) + sizeof(numNames) || std::memcmp(Data, BinaryPrimariesV2::Magic, sizeof(BinaryPrimariesV2::Magic)) != 0)
+        SM.terminateSession("Unexpected format of the binary file with primaries");
+    std::memcpy(&numNames, Data + sizeof(BinaryPrimariesV2::Magic), sizeof(numNames));
+    Pos = sizeof(BinaryPrimariesV2::Magic) + sizeof(numNames);
+
+    std::vector<std::string> names;
+    for (uint32_t i = 0; i < numNames; i++)
+    {
+        uint16_t length = 0;
+        if (Pos + sizeof(length) > Size) SM.terminateSession("Unexpected end of the binary file with primaries");
+        std::memcpy(&length, Data + Pos, sizeof(length));
+        Pos += sizeof(length);
+
+        if (Pos + length > Size) SM.terminateSession("Unexpected end of the binary file with primaries");
+        names.emplace_back(Data + Pos, length);
+        Pos += length;
+    }
+    V2.setNames(std::move(names));
+}
+
+bool MappedBinaryPrimariesReader::readV2EventHeader()
+{
+    NextEventId.clear();
+    EventPosition = Pos;
+
+    int32_t eventId;
+    if (Pos + sizeof(eventId) + sizeof(NumRecords) > Size) return false;
+    std::memcpy(&eventId,    Data + Pos,                   sizeof(eventId));
+    std::memcpy(&NumRecords, Data + Pos + sizeof(eventId), sizeof(NumRecords));
+    Pos += sizeof(eventId) + sizeof(NumRecords);
+
+    NextEventId = '#' + std::to_string(eventId);
+    return true;
+}
+
+size_t MappedBinaryPrimariesReader::getV2EventSize()
+{
+    // checked against the file size before anything is allocated: the record count of a corrupted header can be anything
+    const size_t size = (size_t)NumRecords * sizeof(BinaryPrimariesV2::Record);
+    if (size > Size - Pos)
+        SessionManager::getInstance().terminateSession("Unexpected end of the binary file with primaries");
+    return size;
+}
+
+bool MappedBinaryPrimariesReader::readHeader()
+{
+    NextEventId.clear();
+    if (Pos + 1 + sizeof(int) > Size || Data[Pos] != (char)0xEE) return false;
+
+    int eventId;
+    std::memcpy(&eventId, Data + Pos + 1, sizeof(int));
+    Pos += 1 + sizeof(int);
+    NextEventId = '#' + std::to_string(eventId);
+    return true;
+}
+
+const char * MappedBinaryPrimariesReader::findNameEnd(size_t dataSize)
+{
+    const char * name = Data + Pos + 1;
+    const char * end  = (const char*)std::memchr(name, 0x00, Size - Pos - 1);
+    if (!end || (size_t)(end + 1 - Data) + dataSize > Size)
+        SessionManager::getInstance().terminateSession("Unexpected end of the binary file with primaries");
+    return end;
+}
+
+void MappedBinaryPrimariesReader::readEvent(std::vector<ParticleRecord> & primaries)
+{
+    if (Version == 2)
+    {
+        const size_t size = getV2EventSize();
+        V2.decode(Data + Pos, NumRecords, primaries, *this);
+        Pos += size;
+        readV2EventHeader();
+        return;
+    }
+
+    NextEventId.clear();
+
+    while (Pos < Size)
+    {
+        const char ch = Data[Pos];
+        if (ch == (char)0xEE)
+        {
+            readHeader();
+            return; //event finished
+        }
+        if (ch != (char)0xFF && ch != (char)0xFE)
+        {
+            Pos++;
+            continue;
+        }
+
+        const size_t dataSize = getRecordDataSize(ch);
+        const char * nameEnd = findNameEnd(dataSize);
+
+        ParticleRecord r;
+        r.Particle = findParticle(std::string(Data + Pos + 1, nameEnd), primaries.size());
+
+        double d[9];
+        std::memcpy(d, nameEnd + 1, dataSize);
+        r.Energy    = d[0];
+        r.Position  = {d[1], d[2], d[3]};
+        r.Direction = {d[4], d[5], d[6]};
+        r.Time      = d[7];
+        if (dataSize == WeightedRecordDataSize) r.Weight = d[8];
+        primaries.push_back(r);
+
+        Pos = (nameEnd + 1 - Data) + dataSize;
+    }
+}
+
+bool MappedBinaryPrimariesReader::skipEvent()
+{
+    if (Version == 2)
+    {
+        Pos += getV2EventSize();
+        return readV2EventHeader();
+    }
+
+    NextEventId.clear();
+
+    while (Pos < Size)
+    {
+        const char ch = Data[Pos];
+        if (ch == (char)0xEE) return readHeader();
+        if (ch == (char)0xFF || ch == (char)0xFE) Pos = (findNameEnd(getRecordDataSize(ch)) + 1 - Data) + getRecordDataSize(ch);
+        else Pos++;
+    }
+    return false;
+}
+
+void MappedBinaryPrimariesReader::setPosition(long position, const std::string & eventId, long)
+{
+    Pos = std::min((size_t)position, Size);
+    if (Version == 2) readV2EventHeader();
+    else NextEventId = eventId;
+}
+
+void MappedBinaryPrimariesReader::collectParticleNames(std::unordered_set<std::string> & names, size_t maxBytes) const
+{
+    if (Version == 2)
+    {
+        names.insert(V2.getNames().begin(), V2.getNames().end());
+        return;
+    }
+
+    const size_t end = std::min(Size, Pos + maxBytes);
+    const char * last = nullptr; // usually the same name repeats: no lookup then
+    size_t lastSize = 0;
+
+    size_t pos = Pos;
+    while (pos < end)
+    {
+        const char ch = Data[pos];
+        if (ch == (char)0xEE) pos += 1 + sizeof(int);
+        else if (ch == (char)0xFF || ch == (char)0xFE)
+        {
+            const char * name    = Data + pos + 1;
+            const char * nameEnd = (const char*)std::memchr(name, 0x00, Size - pos - 1);
+            if (!nameEnd) return;
+
+            const size_t size = nameEnd - name;
+            if (!last || size != lastSize || std::memcmp(name, last, size) != 0)
+            {
+                names.emplace(name, size);
+                last = name;
+                lastSize = size;
+            }
+            pos = (nameEnd + 1 - Data) + getRecordDataSize(ch);
+        }
+        else pos++;
+    }
+}
+
+// ---- text formats ----
+
+TextPrimariesReader::TextPrimariesReader(const std::vector<G4ParticleDefinition*> * particleCollection) :
+    ParticleCollection(particleCollection) {}
+
+bool TextPrimariesReader::open(const std::string & fileName)
+{
+    if (!openStream(fileName)) return false;
+
+    Buffer.resize(BufferSize);
+    Begin = End = 0;
+    BufferOffset = 0;
+    bStreamEnd = false;
+    LineNumber = 0;
+
+    const char * begin;
+    const char * end;
+    if (!readLine(begin, end) || end - begin < 2 || *begin != '#')
+        SessionManager::getInstance().terminateSession("Unexpected format of the file with primaries");
+    NextEventId.assign(begin, end);
+    return true;
+}
+
+void TextPrimariesReader::fillBuffer()
+{
+    // the incomplete line is moved to the front; the buffer grows only if a single line does not fit
+    if (Begin > 0)
+    {
+        std::memmove(Buffer.data(), Buffer.data() + Begin, End - Begin);
+        BufferOffset += Begin;
+        End -= Begin;
+        Begin = 0;
+    }
+    if (End == Buffer.size()) Buffer.resize(2 * Buffer.size());
+
+    std::streamsize numRead = 0;
+    if (bPipe)
+    {
+        // whatever the writer has provided: read() would wait until the whole buffer is filled
+        if (Stream.peek() != std::istream::traits_type::eof())
+            numRead = Stream.readsome(Buffer.data() + End, Buffer.size() - End);
+    }
+    else
+    {
+        Stream.read(Buffer.data() + End, Buffer.size() - End);
+        numRead = Stream.gcount();
+    }
+    End += numRead;
+    if (numRead == 0) bStreamEnd = true;
+}
+
+bool TextPrimariesReader::readLine(const char * & begin, const char * & end)
+{
+    while (true)
+    {
+        const char * data = Buffer.data();
+        const char * lineBreak = (const char*)std::memchr(data + Begin, '\n', End - Begin);
+        if (lineBreak || (bStreamEnd && Begin < End))
+        {
+            begin = data + Begin;
+            end   = (lineBreak ? lineBreak : data + End);
+            Begin = (end - data) + (lineBreak ? 1 : 0);
+            if (end > begin && end[-1] == '\r') end--;
+            LineNumber++;
+            return true;
+        }
+        if (bStreamEnd) return false;
+        fillBuffer();
+    }
+}
+
+namespace
+{
+    inline bool isSpace(char ch) {return ch == ' ' || ch == '\t';}
+
+    inline const char * skipSpaces(const char * p, const char * end)
+    {
+        while (p < end && isSpace(*p)) p++;
+        return p;
+    }
+
+    // the number has to be followed by a space or the end of the line; p is advanced past it
+    inline bool parseNumber(const char * & p, const char * end, double & value)
+    {
+        p = skipSpaces(p, end);
+        if (p < end && *p == '+') p++;
+        const std::from_chars_result res = std::from_chars(p, end, value);
+        if (res.ec != std::errc() || (res.ptr < end && !isSpace(*res.ptr))) return false;
+        p = res.ptr;
+        return true;
+    }
+}
+
+bool TextPrimariesReader::parseRecord(const char * p, const char * end, ParticleRecord & r, size_t index)
+{
+    if (ParticleCollection)
+    {
+        int Id;
+        const std::from_chars_result res = std::from_chars(p, end, Id);
+        if (res.ec != std::errc() || (res.ptr < end && !isSpace(*res.ptr))) return false;
+        p = res.ptr;
+
+        if (Id >= 0 && Id < (int)ParticleCollection->size())
+            r.Particle = (*ParticleCollection)[Id];
+        if (!r.Particle)
+            reportError("Use of unknown particle index");
+    }
+    else
+    {
+        const char * nameEnd = p;
+        while (nameEnd < end && !isSpace(*nameEnd)) nameEnd++;
+        ParticleName.assign(p, nameEnd);
+        p = nameEnd;
+    }
+
+    double * fields[8] = {&r.Energy,
+                          &r.Position[0],  &r.Position[1],  &r.Position[2],
+                          &r.Direction[0], &r.Direction[1], &r.Direction[2],
+                          &r.Time};
+    for (double * field : fields)
+        if (!parseNumber(p, end, *field)) return false;
+
+    p = skipSpaces(p, end);
+    if (p != end && !parseNumber(p, end, r.Weight)) return false; // optional weight
+    if (skipSpaces(p, end) != end) return false;
+
+    if (!ParticleCollection)
+        r.Particle = findParticle(ParticleName, index);
+    return true;
+}
+
+void TextPrimariesReader::reportError(const std::string & message)
+{
+    SessionManager::getInstance().terminateSession(message + " (line " + std::to_string(LineNumber) + " of the file with primaries)");
+}
+
+void TextPrimariesReader::readEvent(std::vector<ParticleRecord> & primaries)
+{
+    NextEventId.clear();
+
+    const char * begin;
+    const char * end;
+    while (readLine(begin, end))
+    {
+        if (begin < end && *begin == '#')
+        {
+            NextEventId.assign(begin, end);
+            break; //event finished
+        }
+
+        begin = skipSpaces(begin, end);
+        if (begin == end) continue; //allow empty lines
+
+        primaries.emplace_back();
+        if (!parseRecord(begin, end, primaries.back(), primaries.size() - 1))
+            reportError("Unexpected format of the record");
+    }
+}
+
+bool TextPrimariesReader::skipEvent()
+{
+    NextEventId.clear();
+
+    const char * begin;
+    const char * end;
+    while (readLine(begin, end))
+    {
+        if (begin < end && *begin == '#')
+        {
+            NextEventId.assign(begin, end);
+            return true;
+        }
+    }
+    return false;
+}
+
+long TextPrimariesReader::getPosition()
+{
+    return BufferOffset + (long)Begin;
+}
+
+void TextPrimariesReader::setPosition(long position, const std::string & eventId, long lineNumber)
+{
+    Stream.clear();
+    Begin = End = 0;
+    bStreamEnd = false;
+
+    if (lineNumber >= 0)
+    {
+        Stream.seekg(position);
+        BufferOffset = position;
+        LineNumber   = lineNumber;
+        NextEventId  = eventId;
+        return;
+    }
+
+    // the line is unknown: re-read from the start to keep the line numbers of the error messages right
+    // (only used at resume and after counting the events, so the cost is paid once)
+    Stream.seekg(0);
+    BufferOffset = 0;
+    LineNumber = 0;
+
+    const char * begin;
+    const char * end;
+    while (getPosition() < position && readLine(begin, end)) ;
+
+    if (getPosition() == position) NextEventId = eventId;
+    else NextEventId.clear();
+}
+
+// ---- background prefetch ----
+
+PrefetchingPrimariesReader::PrefetchingPrimariesReader(PrimariesReader * openedReader, int depth) :
+    S(std::make_shared<State>())
+{
+    S->Reader = openedReader;
+    S->Depth  = std::max(1, depth);
+    startThread();
+    popBatch(nullptr); // only waits for the first event
+}
+
+PrefetchingPrimariesReader::~PrefetchingPrimariesReader()
+{
+    if (!Thread.joinable()) return;
+
+    if (S->Reader->isSeekable())
+    {
+        stopThread();
+        return;
+    }
+
+    // pipe: the thread can be blocked in reading until the writer provides data or closes its end, which may never happen
+    {
+        std::lock_guard<std::mutex> lock(S->Mutex);
+        S->bStop = true;
+    }
+    S->Condition.notify_all();
+    Thread.detach();
+}
+
+bool PrefetchingPrimariesReader::open(const std::string & fileName)
+{
+    stopThread();
+    S->Queue.clear();
+    S->ErrorMessage.clear();
+    if (!S->Reader->open(fileName)) return false;
+
+    startThread();
+    popBatch(nullptr);
+    return true;
+}
+
+void PrefetchingPrimariesReader::startThread()
+{
+    S->bFinished = false;
+    S->bStop     = false;
+    Thread = std::thread(&PrefetchingPrimariesReader::prefetch, S);
+}
+
+void PrefetchingPrimariesReader::stopThread()
+{
+    if (!Thread.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(S->Mutex);
+        S->bStop = true;
+    }
+    S->Condition.notify_all();
+
+    Thread.join();
+    S->Reader->UnresolvedNames = nullptr; // pointed to the batch of the thread
+}
+
+void PrefetchingPrimariesReader::prefetch(std::shared_ptr<State> s)
+{
+    // format errors of the wrapped reader come as exceptions and are reported by the consumer (popBatch)
+    SessionManager::throwOnTerminationInThisThread();
+
+    PrimariesReader * reader = s->Reader;
+    while (true)
+    {
+        Batch batch;
+        {
+            std::unique_lock<std::mutex> lock(s->Mutex);
+            s->Condition.wait(lock, [&s]{return s->bStop || s->Queue.size() < s->Depth;});
+            if (s->bStop) return;
+
+            if (reader->isExhausted())
+            {
+                s->bFinished = true;
+                s->Condition.notify_all();
+                return;
+            }
+
+            if (!s->FreeBuffers.empty())
+            {
+                batch.Primaries.swap(s->FreeBuffers.back());
+                s->FreeBuffers.pop_back();
+            }
+        }
+
+        // the wrapped reader is used only by this thread while it runs
+        batch.EventId    = reader->NextEventId;
+        batch.Position   = reader->getPosition();
+        batch.LineNumber = reader->getLineNumber();
+        reader->UnresolvedNames = &batch.UnresolvedNames;
+        try
+        {
+            reader->readEvent(batch.Primaries);
+        }
+        catch (const std::runtime_error & e)
+        {
+            std::lock_guard<std::mutex> lock(s->Mutex);
+            s->ErrorMessage = e.what();
+            s->ErrorEventId = batch.EventId;
+            s->bFinished = true;
+            s->Condition.notify_all();
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(s->Mutex);
+            s->Queue.push_back(std::move(batch));
+        }
+        s->Condition.notify_all();
+    }
+}
+
+void PrefetchingPrimariesReader::popBatch(std::vector<ParticleRecord> * primaries)
+{
+    std::string error;
+    {
+        std::unique_lock<std::mutex> lock(S->Mutex);
+
+        if (primaries)
+        {
+            S->Condition.wait(lock, [this]{return S->bFinished || !S->Queue.empty();});
+            if (S->Queue.empty()) error = S->ErrorMessage; // the failed event is the current one
+            else
+            {
+                Batch & batch = S->Queue.front();
+                const size_t first = primaries->size();
+                if (primaries->empty()) primaries->swap(batch.Primaries); // the old (empty) buffer goes back to the thread
+                else primaries->insert(primaries->end(), batch.Primaries.begin(), batch.Primaries.end());
+                batch.Primaries.clear();
+                S->FreeBuffers.push_back(std::move(batch.Primaries));
+
+                Unresolved.swap(batch.UnresolvedNames);
+                for (auto & u : Unresolved) u.first += first;
+                S->Queue.pop_front();
+                S->Condition.notify_all();
+            }
+        }
+
+        // the header of the next event is known only when the thread has decoded it or has reached the end
+        S->Condition.wait(lock, [this]{return S->bFinished || !S->Queue.empty();});
+        if (!S->Queue.empty())             NextEventId = S->Queue.front().EventId;
+        else if (!S->ErrorMessage.empty()) NextEventId = S->ErrorEventId; // the error is reported when this event is read
+        else                               NextEventId.clear();
+    }
+
+    // outside of the lock: terminating the session destroys the reader
+    if (!error.empty()) SessionManager::getInstance().terminateSession(error);
+}
+
+void PrefetchingPrimariesReader::readEvent(std::vector<ParticleRecord> & primaries)
+{
+    // stopped by skipEvent: continues from the current event of the wrapped reader after the events decoded before
+    if (!Thread.joinable() && S->ErrorMessage.empty()) startThread();
+
+    Unresolved.clear();
+    popBatch(&primaries);
+
+    // the names which were not resolved in advance are resolved here, in the Geant4 thread of the consumer
+    SessionManager & SM = SessionManager::getInstance();
+    for (const auto & u : Unresolved)
+        primaries[u.first].Particle = SM.findGeant4Particle(u.second); // terminates session if not found
+}
+
+bool PrefetchingPrimariesReader::dropBatch()
+{
+    if (S->Queue.empty()) return false;
+
+    Batch & batch = S->Queue.front();
+    batch.Primaries.clear();
+    S->FreeBuffers.push_back(std::move(batch.Primaries));
+    S->Queue.pop_front();
+    S->Condition.notify_all();
+    return true;
+}
+
+bool PrefetchingPrimariesReader::skipEvent()
+{
+    // the decoded events are dropped; the thread is stopped for the rest, so the wrapped reader skips them without decoding
+    bool bDropped;
+    {
+        std::lock_guard<std::mutex> lock(S->Mutex);
+        bDropped = dropBatch();
+        if (bDropped && !S->Queue.empty())
+        {
+            NextEventId = S->Queue.front().EventId;
+            return true;
+        }
+    }
+
+    stopThread();
+    if (!bDropped) bDropped = dropBatch(); // decoded by the thread before it stopped
+    if (!S->Queue.empty())
+    {
+        NextEventId = S->Queue.front().EventId;
+        return true;
+    }
+
+    if (!S->ErrorMessage.empty())
+    {
+        // the state of the wrapped reader is unknown after the failure
+        if (!bDropped) SessionManager::getInstance().terminateSession(S->ErrorMessage);
+        NextEventId = S->ErrorEventId;
+        return true;
+    }
+
+    if (!bDropped) S->Reader->skipEvent();
+    NextEventId = S->Reader->NextEventId;
+    return !NextEventId.empty();
+}
+
+long PrefetchingPrimariesReader::getPosition()
+{
+    std::lock_guard<std::mutex> lock(S->Mutex);
+    if (!S->Queue.empty()) return S->Queue.front().Position;
+    return S->Reader->getPosition(); // the thread is finished or stopped: it does not use the reader any more
+}
+
+long PrefetchingPrimariesReader::getLineNumber() const
+{
+    std::lock_guard<std::mutex> lock(S->Mutex);
+    if (!S->Queue.empty()) return S->Queue.front().LineNumber;
+    return S->Reader->getLineNumber();
+}
+
+void PrefetchingPrimariesReader::setPosition(long position, const std::string & eventId, long lineNumber)
+{
+    stopThread();
+    S->Queue.clear();
+    S->ErrorMessage.clear();
+    S->Reader->setPosition(position, eventId, lineNumber);
+    startThread();
+    popBatch(nullptr);
+}
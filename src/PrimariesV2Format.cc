@@ -0,0 +1,47 @@
+#include "PrimariesV2Format.hh"
+
+constexpr char PrimariesV2Format::Magic[8];
+
+void PrimariesV2Format::Record::setWeight(double weight)
+{
+    Particle = getParticleIndex();
+    if (weight == 1.0) Weight = 0;
+    else
+    {
+        Particle |= WeightedFlag;
+        Weight = (float)weight;
+    }
+}
+
+PrimariesV2Writer::PrimariesV2Writer(std::ostream & stream, const std::vector<std::string> & names) :
+    Stream(stream)
+{
+    if (names.size() > PrimariesV2Format::MaxNames)
+    {
+        Stream.setstate(std::ios::failbit);
+        return;
+    }
+
+    const uint32_t numNames = names.size();
+    Stream.write(PrimariesV2Format::Magic, sizeof(PrimariesV2Format::Magic));
+    Stream.write((const char*)&numNames, sizeof(numNames));
+    for (const std::string & name : names)
+    {
+        if (name.size() > UINT16_MAX)
+        {
+            Stream.setstate(std::ios::failbit);
+            return;
+        }
+        const uint16_t length = name.size();
+        Stream.write((const char*)&length, sizeof(length));
+        Stream.write(name.data(), length);
+    }
+}
+
+void PrimariesV2Writer::writeEvent(int32_t eventNumber, const std::vector<PrimariesV2Format::Record> & records)
+{
+    const uint32_t numRecords = records.size();
+    Stream.write((const char*)&eventNumber, sizeof(eventNumber));
+    Stream.write((const char*)&numRecords, sizeof(numRecords));
+    Stream.write((const char*)records.data(), records.size() * sizeof(PrimariesV2Format::Record));
+}
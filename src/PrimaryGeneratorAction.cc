@@ -1,42 +1,47 @@
 #include "PrimaryGeneratorAction.hh"
 #include "SessionManager.hh"
+#include "SessionContext.hh"
 
 #include "G4Event.hh"
-#include "G4ParticleGun.hh"
+#include "G4PrimaryVertex.hh"
+#include "G4PrimaryParticle.hh"
 #include "G4ParticleDefinition.hh"
 #include "G4SystemOfUnits.hh"
 
 PrimaryGeneratorAction::PrimaryGeneratorAction()
-    : G4VUserPrimaryGeneratorAction()
-{
-    G4int nofParticles = 1;
-    fParticleGun = new G4ParticleGun(nofParticles);
-}
+    : G4VUserPrimaryGeneratorAction() {}
 
-PrimaryGeneratorAction::~PrimaryGeneratorAction()
-{
-    delete fParticleGun;
-}
+PrimaryGeneratorAction::~PrimaryGeneratorAction() {}
 
-#include "G4IonTable.hh"
 void PrimaryGeneratorAction::GeneratePrimaries(G4Event* anEvent)
 {
     SessionManager & SM = SessionManager::getInstance();
+    SessionContext & C = SM.getContext();
     const std::vector<ParticleRecord> & GeneratedPrimaries = SM.getNextEventPrimaries();
+    SM.seedEventRandomEngine(); // if configured: the event does not depend on the preceding ones
+
+    // only consecutive records are merged into one vertex: the order of the primaries (and so their track IDs) is kept
+    G4PrimaryVertex * vertex = nullptr;
+    const ParticleRecord * vertexRecord = nullptr;
 
     for (const ParticleRecord & r : GeneratedPrimaries)
     {
         //std::cout << r.Particle->GetParticleName() <<" Pos:"<<r.Position[0]<<" "<<r.Position[1]<<" "<<r.Position[2] <<" Dir:"<<
         //             r.Direction[0]<<" "<<r.Direction[1]<<" "<<r.Direction[2]<<" E:"<< r.Energy <<" T:"<< r.Time << std::endl;
 
-        fParticleGun->SetParticleDefinition(r.Particle);
-        fParticleGun->SetParticlePosition(r.Position); //position in millimeters - no need units
-        fParticleGun->SetParticleMomentumDirection(r.Direction);
-        fParticleGun->SetParticleEnergy(r.Energy*keV);
-        fParticleGun->SetParticleTime(r.Time); //in ns - no need units
+        if (!vertex || r.Position != vertexRecord->Position || r.Time != vertexRecord->Time)
+        {
+            vertex = new G4PrimaryVertex(r.Position, r.Time); //position in millimeters, time in ns - no need units
+            vertexRecord = &r;
+            anEvent->AddPrimaryVertex(vertex);
+        }
 
-        fParticleGun->GeneratePrimaryVertex(anEvent);
+        G4PrimaryParticle * particle = new G4PrimaryParticle(r.Particle); // charge and mass from the definition, as the particle gun does
+        particle->SetKineticEnergy(r.Energy*keV);
+        particle->SetMomentumDirection(r.Direction.unit()); // the gun normalized it too
+        particle->SetWeight(r.Weight);                      // inherited by the track and its secondaries
+        vertex->SetPrimary(particle);
 
-        SM.incrementPredictedTrackID();
+        C.NextTrackID++;
     }
 }
@@ -0,0 +1,317 @@
+#include "PrimarySource.hh"
+#include "SessionManager.hh"
+
+#include "G4VPhysicalVolume.hh"
+#include "G4LogicalVolume.hh"
+#include "G4VSolid.hh"
+#include "G4TransportationManager.hh"
+#include "G4Navigator.hh"
+
+#include <cmath>
+#include <random>
+#include <algorithm>
+
+uint64_t PrimarySource::Random::operator()()
+{
+    uint64_t z = (State += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+namespace
+{
+    G4ThreeVector readVector(const json11::Json & json, const G4ThreeVector & def)
+    {
+        const std::vector<json11::Json> & ar = json.array_items();
+        if (ar.empty()) return def;
+        if (ar.size() != 3) SessionManager::getInstance().terminateSession("PrimarySource: 3D vector expected");
+        return {ar[0].number_value(), ar[1].number_value(), ar[2].number_value()};
+    }
+}
+
+PrimarySource::PrimarySource(const json11::Json & json, uint64_t seed) :
+    Seed(seed)
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    NumEvents = (long)json["NumEvents"].number_value();
+    if (NumEvents <= 0) SM.terminateSession("PrimarySource: NumEvents has to be positive");
+
+    ParticleName = json["Particle"].string_value();
+    if (ParticleName.empty()) SM.terminateSession("PrimarySource: Particle is not provided");
+
+    // per event: fixed number of primaries or Poisson-distributed with this mean
+    Multiplicity = 1;
+    if (json.object_items().count("Multiplicity") != 0) Multiplicity = json["Multiplicity"].number_value();
+    bPoissonMultiplicity = json["PoissonMultiplicity"].bool_value();
+    if (Multiplicity <= 0 || (!bPoissonMultiplicity && Multiplicity != std::floor(Multiplicity)))
+        SM.terminateSession("PrimarySource: Multiplicity has to be a positive integer (or a positive mean with PoissonMultiplicity)");
+
+    Time = json["Time"].number_value();
+
+    readPosition(json["Position"]);
+    readDirection(json["Direction"]);
+    readEnergy(json["Energy"]);
+}
+
+void PrimarySource::readPosition(const json11::Json & json)
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    const std::string shape = json["Shape"].string_value();
+    Center = readVector(json["Center"], {0, 0, 0});
+
+    if      (shape.empty() || shape == "Point") Shape = Point;
+    else if (shape == "Box")
+    {
+        Shape = Box;
+        Size = readVector(json["Size"], {0, 0, 0});
+    }
+    else if (shape == "Cylinder")
+    {
+        Shape = Cylinder;
+        Radius = json["Radius"].number_value();
+        Length = json["Length"].number_value();
+    }
+    else if (shape == "Volume")
+    {
+        Shape = Volume;
+        VolumeName = json["Volume"].string_value();
+        if (VolumeName.empty()) SM.terminateSession("PrimarySource: Volume is not provided");
+        bIncludeDaughters = json["IncludeDaughters"].bool_value();
+    }
+    else SM.terminateSession("PrimarySource: unknown position shape " + shape);
+}
+
+void PrimarySource::readDirection(const json11::Json & json)
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    const std::string type = json["Type"].string_value();
+    if      (type.empty() || type == "Isotropic") Direction = Isotropic;
+    else if (type == "Cone")                      Direction = Cone;
+    else if (type == "Beam")                      Direction = Beam;
+    else SM.terminateSession("PrimarySource: unknown direction type " + type);
+
+    Axis = readVector(json["Axis"], {0, 0, 1});
+    if (Axis.mag2() == 0) SM.terminateSession("PrimarySource: direction axis is a zero vector");
+    Axis  = Axis.unit();
+    AxisU = Axis.orthogonal().unit();
+    AxisV = Axis.cross(AxisU);
+
+    const double halfAngle = json["HalfAngle"].number_value(); // degrees
+    if (Direction == Cone && (halfAngle <= 0 || halfAngle > 180)) SM.terminateSession("PrimarySource: cone HalfAngle has to be in (0, 180] degrees");
+    CosHalfAngle = std::cos(halfAngle * M_PI / 180.0);
+}
+
+void PrimarySource::readEnergy(const json11::Json & json)
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    const std::string type = json["Type"].string_value();
+    if (type.empty() || type == "Mono")
+    {
+        Energy = Mono;
+        MonoEnergy = json["Energy"].number_value();
+        if (MonoEnergy <= 0) SM.terminateSession("PrimarySource: Energy has to be positive");
+        return;
+    }
+
+    // [[energy, weight], ...]
+    // spectrum, "Interpolation": "Histogram" (default) - weight of the bin from this energy to the next one, the last weight is not used
+    //                            "Linear"              - density at this energy, linear between the points
+    const std::vector<json11::Json> * ar = nullptr;
+    if      (type == "Spectrum") {Energy = Spectrum; ar = &json["Spectrum"].array_items();}
+    else if (type == "Lines")    {Energy = Lines;    ar = &json["Lines"].array_items();}
+    else SM.terminateSession("PrimarySource: unknown energy type " + type);
+
+    EnergyPoints.clear();
+    std::vector<double> weights;
+    for (const json11::Json & el : *ar)
+    {
+        EnergyPoints.push_back(el[0].number_value());
+        weights.push_back(el[1].number_value());
+        if (weights.back() < 0) SM.terminateSession("PrimarySource: negative weight in the energy distribution");
+    }
+
+    if (Energy == Spectrum)
+    {
+        if (EnergyPoints.size() < 2 || !std::is_sorted(EnergyPoints.begin(), EnergyPoints.end()))
+            SM.terminateSession("PrimarySource: spectrum needs at least two points with increasing energy");
+
+        const std::string interpolation = json["Interpolation"].string_value();
+        if      (interpolation.empty() || interpolation == "Histogram") bLinearSpectrum = false;
+        else if (interpolation == "Linear")                             bLinearSpectrum = true;
+        else SM.terminateSession("PrimarySource: unknown spectrum interpolation " + interpolation);
+
+        if (bLinearSpectrum)
+        {
+            EnergyDensity = weights;
+            for (size_t i = 0; i + 1 < weights.size(); i++)
+                weights[i] = 0.5 * (EnergyDensity[i] + EnergyDensity[i+1]) * (EnergyPoints[i+1] - EnergyPoints[i]);
+        }
+        weights.pop_back();
+    }
+
+    if (!EnergySampler.build(weights))
+        SM.terminateSession("PrimarySource: empty energy distribution or all its weights are zero");
+}
+
+bool PrimarySource::open(const std::string &)
+{
+    SessionManager & SM = SessionManager::getInstance();
+
+    Particle = SM.findGeant4Particle(ParticleName); // terminates session if not found
+
+    if (Shape == Volume)
+    {
+        const G4VPhysicalVolume * world = G4TransportationManager::GetTransportationManager()->GetNavigatorForTracking()->GetWorldVolume();
+        VolumeSolid = nullptr;
+        const int numPlacements = (world ? findVolume(world, G4AffineTransform()) : 0);
+        if (numPlacements == 0) SM.terminateSession("PrimarySource: volume " + VolumeName + " not found");
+        if (numPlacements > 1)  SM.terminateSession("PrimarySource: volume " + VolumeName + " is ambiguous: its logical volume has " + std::to_string(numPlacements) + " placements");
+        VolumeSolid->BoundingLimits(VolumeMin, VolumeMax);
+    }
+
+    setPosition(0, "");
+    return true;
+}
+
+int PrimarySource::findVolume(const G4VPhysicalVolume * pv, const G4AffineTransform & motherToGlobal)
+{
+    // by the name of the logical volume, as the sensitive volumes of the config; the first placement found depth-first is used
+    int numFound = 0;
+    const G4AffineTransform toGlobal = G4AffineTransform(pv->GetRotation(), pv->GetTranslation()) * motherToGlobal;
+    const G4LogicalVolume * lv = pv->GetLogicalVolume();
+    if ((std::string)lv->GetName() == VolumeName)
+    {
+        numFound++;
+        if (!VolumeSolid)
+        {
+            VolumeSolid    = lv->GetSolid();
+            VolumeToGlobal = toGlobal;
+
+            // replicated and parameterised daughters are tested at their last placement only
+            VolumeDaughters.clear();
+            for (int i = 0; i < (int)lv->GetNoDaughters(); i++)
+            {
+                const G4VPhysicalVolume * d = lv->GetDaughter(i);
+                VolumeDaughters.emplace_back(d->GetLogicalVolume()->GetSolid(), G4AffineTransform(d->GetRotation(), d->GetTranslation()).Inverse());
+            }
+        }
+    }
+
+    for (int i = 0; i < (int)lv->GetNoDaughters(); i++)
+        numFound += findVolume(lv->GetDaughter(i), toGlobal);
+    return numFound;
+}
+
+void PrimarySource::setPosition(long position, const std::string &, long)
+{
+    EventIndex = position;
+    if (EventIndex < NumEvents) NextEventId = '#' + std::to_string(EventIndex);
+    else NextEventId.clear();
+}
+
+bool PrimarySource::skipEvent()
+{
+    setPosition(EventIndex + 1, "");
+    return !isExhausted();
+}
+
+void PrimarySource::collectParticleNames(std::unordered_set<std::string> & names, size_t) const
+{
+    names.insert(ParticleName);
+}
+
+void PrimarySource::readEvent(std::vector<ParticleRecord> & primaries)
+{
+    Random rnd(Seed ^ Random(EventIndex)());
+
+    int num = (int)Multiplicity;
+    if (bPoissonMultiplicity) num = std::poisson_distribution<int>(Multiplicity)(rnd);
+
+    for (int i = 0; i < num; i++)
+    {
+        ParticleRecord r;
+        r.Particle  = Particle;
+        r.Position  = generatePosition(rnd);
+        r.Direction = generateDirection(rnd);
+        r.Energy    = generateEnergy(rnd);
+        r.Time      = Time;
+        primaries.push_back(r);
+    }
+
+    skipEvent();
+}
+
+G4ThreeVector PrimarySource::generatePosition(Random & rnd) const
+{
+    switch (Shape)
+    {
+    case Point:
+        return Center;
+    case Box:
+        return {Center[0] + (rnd.uniform() - 0.5) * Size[0],
+                Center[1] + (rnd.uniform() - 0.5) * Size[1],
+                Center[2] + (rnd.uniform() - 0.5) * Size[2]};
+    case Cylinder:
+    {
+        const double r   = Radius * std::sqrt(rnd.uniform());
+        const double phi = 2.0 * M_PI * rnd.uniform();
+        return {Center[0] + r * std::cos(phi), Center[1] + r * std::sin(phi), Center[2] + (rnd.uniform() - 0.5) * Length};
+    }
+    case Volume:
+        // rejection in the bounding box; the points in the daughters are accepted only with IncludeDaughters
+        for (int attempt = 0; attempt < 1000000; attempt++)
+        {
+            const G4ThreeVector local = {VolumeMin[0] + rnd.uniform() * (VolumeMax[0] - VolumeMin[0]),
+                                         VolumeMin[1] + rnd.uniform() * (VolumeMax[1] - VolumeMin[1]),
+                                         VolumeMin[2] + rnd.uniform() * (VolumeMax[2] - VolumeMin[2])};
+            if (VolumeSolid->Inside(local) != kInside) continue;
+            if (!bIncludeDaughters && isInDaughter(local)) continue;
+            return VolumeToGlobal.TransformPoint(local);
+        }
+        SessionManager::getInstance().terminateSession("PrimarySource: failed to generate a position inside volume " + VolumeName);
+    }
+    return Center;
+}
+
+bool PrimarySource::isInDaughter(const G4ThreeVector & local) const
+{
+    for (const auto & d : VolumeDaughters)
+        if (d.first->Inside(d.second.TransformPoint(local)) != kOutside) return true;
+    return false;
+}
+
+G4ThreeVector PrimarySource::generateDirection(Random & rnd) const
+{
+    if (Direction == Beam) return Axis;
+
+    const double cosTheta = (Direction == Isotropic ? 2.0 * rnd.uniform() - 1.0
+                                                    : 1.0 - rnd.uniform() * (1.0 - CosHalfAngle));
+    const double sinTheta = std::sqrt(std::max(0.0, 1.0 - cosTheta * cosTheta));
+    const double phi = 2.0 * M_PI * rnd.uniform();
+    return AxisU * (sinTheta * std::cos(phi)) + AxisV * (sinTheta * std::sin(phi)) + Axis * cosTheta;
+}
+
+double PrimarySource::generateEnergy(Random & rnd) const
+{
+    if (Energy == Mono) return MonoEnergy;
+
+    const size_t bin = EnergySampler.sample(rnd.uniform());
+    if (Energy == Lines) return EnergyPoints[bin];
+
+    const double from = EnergyPoints[bin];
+    const double to   = EnergyPoints[bin + 1];
+    const double u    = rnd.uniform();
+    if (!bLinearSpectrum) return from + u * (to - from);
+
+    // inverse of the cumulative of the linear density fa..fb inside the bin
+    const double fa = EnergyDensity[bin];
+    const double fb = EnergyDensity[bin + 1];
+    const double denominator = fa + std::sqrt(fa * fa + u * (fb * fb - fa * fa));
+    const double t = (denominator > 0 ? u * (fa + fb) / denominator : 0);
+    return from + t * (to - from);
+}
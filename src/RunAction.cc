@@ -15,10 +15,7 @@ RunAction::~RunAction() {}
 
 void RunAction::BeginOfRunAction(const G4Run*)
 {
-    SessionManager & SM = SessionManager::getInstance();
-
-    SM.resetPredictedTrackID();
-    SM.writeNewEventMarker();
+    // per-event bookkeeping (event markers, track ID prediction, progress) is handled by EventAction
 
     //inform the runManager to save random number seed             *** need?
     //G4RunManager::GetRunManager()->SetRandomNumberStore(false);
@@ -26,6 +23,7 @@ void RunAction::BeginOfRunAction(const G4Run*)
 
 void RunAction::EndOfRunAction(const G4Run* )
 {
-    SessionManager & SM = SessionManager::getInstance();
-    SM.onRunFinished();
+    // in MT mode master's end of run comes after all workers have finished
+    if (IsMaster())
+        SessionManager::getInstance().onRunFinished();
 }
@@ -1,5 +1,6 @@
 #include "SensitiveDetector.hh"
 #include "SessionManager.hh"
+#include "SessionContext.hh"
 #include "ahistogram.hh"
 
 #include <sstream>
@@ -25,16 +26,18 @@ G4bool SensitiveDetector::ProcessHits(G4Step* aStep, G4TouchableHistory*)
     const int&           iMat = SM.findMaterial( aStep->GetPreStepPoint()->GetMaterial()->GetName() ); //will terminate session if not found!
     const G4ThreeVector& G4pos = aStep->GetPostStepPoint()->GetPosition();
     const double&        time = aStep->GetPostStepPoint()->GetGlobalTime()/ns;
+    const double         weight = aStep->GetTrack()->GetWeight();
 
     double pos[3];
     pos[0] = G4pos.x();
     pos[1] = G4pos.y();
     pos[2] = G4pos.z();
 
-    SM.saveDepoRecord(iPart, iMat, edep, pos, time);
+    SM.saveDepoRecord(iPart, iMat, edep, pos, time, weight);
 
-    if (iPart < 0) SM.DepoByNotRegistered += edep;
-    else SM.DepoByRegistered += edep;
+    SessionContext & C = SM.getContext();
+    if (iPart < 0) C.DepoByNotRegistered += edep * weight;
+    else C.DepoByRegistered += edep * weight;
 
     return true;
 }
@@ -51,6 +54,121 @@ MonitorSensitiveDetector::~MonitorSensitiveDetector()
     std::cout << "Deleting monitor object" << std::endl;
 }
 
+#include "G4ParticleTable.hh"
+MonitorSensitiveDetector * MonitorSensitiveDetector::clone() const
+{
+    MonitorSensitiveDetector * m = new MonitorSensitiveDetector(Name);
+    m->configureFrom(*this);
+    return m;
+}
+
+void MonitorSensitiveDetector::configureFrom(const MonitorSensitiveDetector & other)
+{
+    Name             = other.Name;
+    ParticleName     = other.ParticleName;
+    MonitorIndex     = other.MonitorIndex;
+
+    // workers can be initialized before SessionManager::prepareMonitors() is called
+    pParticleDefinition = nullptr;
+    if (!ParticleName.empty())
+        pParticleDefinition = G4ParticleTable::GetParticleTable()->FindParticle(ParticleName);
+
+    bAcceptLower     = other.bAcceptLower;
+    bAcceptUpper     = other.bAcceptUpper;
+    bAcceptDirect    = other.bAcceptDirect;
+    bAcceptIndirect  = other.bAcceptIndirect;
+    bAcceptPrimary   = other.bAcceptPrimary;
+    bAcceptSecondary = other.bAcceptSecondary;
+    bStopTracking    = other.bStopTracking;
+
+    angleBins   = other.angleBins;   angleFrom  = other.angleFrom;  angleTo  = other.angleTo;
+    energyBins  = other.energyBins;  energyFrom = other.energyFrom; energyTo = other.energyTo; energyUnits = other.energyUnits;
+    timeBins    = other.timeBins;    timeFrom   = other.timeFrom;   timeTo   = other.timeTo;
+    xbins       = other.xbins;       ybins      = other.ybins;
+    size1       = other.size1;       size2      = other.size2;
+
+    deleteHistograms();
+    createHistograms();
+}
+
+void MonitorSensitiveDetector::merge(const MonitorSensitiveDetector & other)
+{
+    hTime    ->merge(*other.hTime);
+    hAngle   ->merge(*other.hAngle);
+    hEnergy  ->merge(*other.hEnergy);
+    hPosition->merge(*other.hPosition);
+}
+
+void MonitorSensitiveDetector::mergeFromJson(const json11::Json & json)
+{
+    mergeHist1DFromJson(hTime,   json["Time"]);
+    mergeHist1DFromJson(hAngle,  json["Angle"]);
+    mergeHist1DFromJson(hEnergy, json["Energy"]);
+
+    const json11::Json & jsSpatial = json["Spatial"];
+    if (jsSpatial["entries"].is_array())
+    {
+        for (const json11::Json & e : jsSpatial["entries"].array_items())
+            hPosition->Fill(e[0].number_value(), e[1].number_value(), e[2].number_value());
+        return;
+    }
+
+    std::vector<std::vector<double>> data;
+    for (const json11::Json & row : jsSpatial["data"].array_items())
+    {
+        std::vector<double> v;
+        for (const json11::Json & d : row.array_items())
+            v.push_back(d.number_value());
+        data.push_back(v);
+    }
+    std::vector<double> stat;
+    for (const json11::Json & d : jsSpatial["stat"].array_items())
+        stat.push_back(d.number_value());
+
+    const double xfrom = jsSpatial["xfrom"].number_value();
+    const double xto   = jsSpatial["xto"].number_value();
+    const double yfrom = jsSpatial["yfrom"].number_value();
+    const double yto   = jsSpatial["yto"].number_value();
+    if (data.size() < 3 || data[0].size() < 3) return;
+    if (!(xto > xfrom) || !(yto > yfrom)) return; // range was never defined: there are no entries
+
+    AHistogram2D h(data[0].size() - 2, xfrom, xto, data.size() - 2, yfrom, yto);
+    h.setContent(data, stat);
+    hPosition->merge(h);
+}
+
+void MonitorSensitiveDetector::mergeHist1DFromJson(AHistogram1D * hist, const json11::Json & json)
+{
+    if (json["entries"].is_array())
+    {
+        for (const json11::Json & e : json["entries"].array_items())
+            hist->Fill(e[0].number_value(), e[1].number_value());
+        return;
+    }
+
+    std::vector<double> data;
+    for (const json11::Json & d : json["data"].array_items())
+        data.push_back(d.number_value());
+    std::vector<double> stat;
+    for (const json11::Json & d : json["stat"].array_items())
+        stat.push_back(d.number_value());
+
+    const double from = json["from"].number_value();
+    const double to   = json["to"].number_value();
+    if (data.size() < 3) return;
+    if (!(to > from)) return; // range was never defined: there are no entries
+
+    AHistogram1D h(data.size() - 2, from, to);
+    h.setContent(data, stat);
+    hist->merge(h);
+}
+
+void MonitorSensitiveDetector::clearData()
+{
+    deleteHistograms();
+    createHistograms();
+}
+
 G4bool MonitorSensitiveDetector::ProcessHits(G4Step *step, G4TouchableHistory *)
 {
     const G4VProcess * proc = step->GetPostStepPoint()->GetProcessDefinedStep();
@@ -68,6 +186,8 @@ G4bool MonitorSensitiveDetector::ProcessHits(G4Step *step, G4TouchableHistory *)
             if (  bIsDirect && !bAcceptDirect)   return true;
             if ( !bIsDirect && !bAcceptIndirect) return true;
 
+            const double weight = step->GetTrack()->GetWeight();
+
             //position info
             G4StepPoint* p1 = step->GetPreStepPoint();
             const G4ThreeVector & coord1 = p1->GetPosition();
@@ -78,11 +198,11 @@ G4bool MonitorSensitiveDetector::ProcessHits(G4Step *step, G4TouchableHistory *)
             if ( localPosition[2] < 0  && !bAcceptLower ) return true;
             const double x = localPosition[0] / mm;
             const double y = localPosition[1] / mm;
-            hPosition->Fill(x, y);
+            hPosition->Fill(x, y, weight);
 
             // time info
             double time = step->GetPostStepPoint()->GetGlobalTime()/ns;
-            hTime->Fill(time);
+            hTime->Fill(time, weight);
 
             // angle info
             G4ThreeVector vec = step->GetTrack()->GetMomentumDirection();
@@ -91,11 +211,11 @@ G4bool MonitorSensitiveDetector::ProcessHits(G4Step *step, G4TouchableHistory *)
             double angle = 180.0/3.14159265358979323846*acos(vec[2]);
             if (angle > 90.0) angle = 180.0 - angle;
             //std::cout << "Local vector: " << vec[0] << " " << vec[1] << " " << vec[2] << " "<< angle << std::endl;
-            hAngle->Fill(angle);
+            hAngle->Fill(angle, weight);
 
             //energy
             double energy = step->GetPostStepPoint()->GetKineticEnergy() / keV;
-            hEnergy->Fill(energy);
+            hEnergy->Fill(energy, weight);
 
             //stop tracking?
             if (bStopTracking)
@@ -103,7 +223,8 @@ G4bool MonitorSensitiveDetector::ProcessHits(G4Step *step, G4TouchableHistory *)
                 step->GetTrack()->SetTrackStatus(fStopAndKill);
 
                 SessionManager & SM = SessionManager::getInstance();
-                if (SM.CollectHistory != SessionManager::NotCollecting)
+                SessionContext & C = SM.getContext();
+                if (C.CollectHistory != SessionManager::NotCollecting)
                 {
                     const G4ThreeVector & pos = step->GetPostStepPoint()->GetPosition();
                     const double kinE = step->GetPostStepPoint()->GetKineticEnergy()/keV;
@@ -114,7 +235,7 @@ G4bool MonitorSensitiveDetector::ProcessHits(G4Step *step, G4TouchableHistory *)
                 }
                 // bug in Geant4.10.5.1? Tracking reports one more step - transportation from the monitor to the next volume
                 //the next is the fix:
-                SM.bStoppedOnMonitor = true;
+                C.bStoppedOnMonitor = true;
                 return true;
             }
         }
@@ -170,12 +291,9 @@ void MonitorSensitiveDetector::readFromJson(const json11::Json &json)
     else                    //round
         size2 = size1;
 
-    // creating histograms to store statistics
-    hTime     = new AHistogram1D(timeBins,   timeFrom,   timeTo);
-    hAngle    = new AHistogram1D(angleBins,  angleFrom,  angleTo);
-    hEnergy   = new AHistogram1D(energyBins, energyFrom, energyTo);
-
-    hPosition = new AHistogram2D(xbins, -size1, size1, ybins, -size2, size2);
+    // creating histograms to store statistics (server mode: the monitor can be reconfigured for the next job)
+    deleteHistograms();
+    createHistograms();
 
     /*
     vTime.resize(timeBins+2);
@@ -192,23 +310,55 @@ void MonitorSensitiveDetector::readFromJson(const json11::Json &json)
     */
 }
 
-void MonitorSensitiveDetector::writeToJson(json11::Json::object &json)
+void MonitorSensitiveDetector::createHistograms()
+{
+    hTime     = new AHistogram1D(timeBins,   timeFrom,   timeTo);
+    hAngle    = new AHistogram1D(angleBins,  angleFrom,  angleTo);
+    hEnergy   = new AHistogram1D(energyBins, energyFrom, energyTo);
+
+    hPosition = new AHistogram2D(xbins, -size1, size1, ybins, -size2, size2);
+
+    // auto range: chosen from all entries only after the copies of the workers and the shards are merged,
+    // so it does not depend on which entries reached which thread or process first
+    hTime    ->setBufferSize(0);
+    hAngle   ->setBufferSize(0);
+    hEnergy  ->setBufferSize(0);
+    hPosition->setBufferSize(0);
+}
+
+void MonitorSensitiveDetector::deleteHistograms()
+{
+    delete hTime;     hTime     = nullptr;
+    delete hAngle;    hAngle    = nullptr;
+    delete hEnergy;   hEnergy   = nullptr;
+    delete hPosition; hPosition = nullptr;
+}
+
+void MonitorSensitiveDetector::writeToJson(json11::Json::object &json, bool bRawEntries)
 {
     json["MonitorIndex"] = MonitorIndex;
 
     json11::Json::object jsTime;
-    writeHist1D(hTime, jsTime);
+    writeHist1D(hTime, jsTime, bRawEntries);
     json["Time"] = jsTime;
 
     json11::Json::object jsAngle;
-    writeHist1D(hAngle, jsAngle);
+    writeHist1D(hAngle, jsAngle, bRawEntries);
     json["Angle"] = jsAngle;
 
     json11::Json::object jsEnergy;
-    writeHist1D(hEnergy, jsEnergy);
+    writeHist1D(hEnergy, jsEnergy, bRawEntries);
     json["Energy"] = jsEnergy;
 
     json11::Json::object jsSpatial;
+    if (bRawEntries && !hPosition->isRangeFixed())
+    {
+        json11::Json::array ar;
+        for (const auto & t : hPosition->getBuffer())
+            ar.push_back(json11::Json::array{std::get<0>(t), std::get<1>(t), std::get<2>(t)});
+        jsSpatial["entries"] = ar;
+    }
+    else
     {
         std::vector<std::vector<double>> vSpatial = hPosition->getContent(); //[y][x]
         json11::Json::array ar;
@@ -238,8 +388,17 @@ void MonitorSensitiveDetector::writeToJson(json11::Json::object &json)
     json["Spatial"] = jsSpatial;
 }
 
-void MonitorSensitiveDetector::writeHist1D(AHistogram1D *hist, json11::Json::object &json) const
+void MonitorSensitiveDetector::writeHist1D(AHistogram1D *hist, json11::Json::object &json, bool bRawEntries) const
 {
+    if (bRawEntries && !hist->isRangeFixed())
+    {
+        json11::Json::array ar;
+        for (const auto & p : hist->getBuffer())
+            ar.push_back(json11::Json::array{p.first, p.second});
+        json["entries"] = ar;
+        return;
+    }
+
     json11::Json::array ar;
     for (const double & d : hist->getContent())
         ar.push_back(d);
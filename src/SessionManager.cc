@@ -1,17 +1,52 @@
 #include "SessionManager.hh"
+#include "SessionContext.hh"
+#include "SensitiveDetector.hh"
+#include "PrimariesReader.hh"
+#include "PrimariesIndex.hh"
+#include "PrimarySource.hh"
 
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
 #include <map>
+#include <limits>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <random>
+#include <charconv>
+#include <stdexcept>
+#include <sys/resource.h>
 
 #include "G4ParticleDefinition.hh"
 #include "G4ParticleTable.hh"
 #include "G4IonTable.hh"
 #include "G4UImanager.hh"
+#include "G4RunManager.hh"
+#include "G4Threading.hh"
 #include "Randomize.hh"
 
+namespace
+{
+    // SplitMix64 finalizer: close inputs give statistically independent outputs
+    uint64_t mix64(uint64_t x)
+    {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+}
+
 SessionManager &SessionManager::getInstance()
 {
     static SessionManager instance; // Guaranteed to be destroyed, instantiated on first use.
@@ -28,14 +63,32 @@ SessionManager::SessionManager()
 
 SessionManager::~SessionManager()
 {
+    for (SessionContext * C : Contexts) delete C;
+
     delete outStreamExit;
     delete outStreamDeposition;
     delete outStreamHistory;
-    delete inStreamPrimaries;
+    delete inPrimaries;
+    delete inIndex;
 }
 
 void SessionManager::startSession()
 {
+    // thread contexts can be left from the previous job (server mode)
+    prepareContexts();
+
+    DepoByRegistered = 0;
+    DepoByNotRegistered = 0;
+    EventsDone = 0;
+    EventsAborted = 0;
+    DepositionBytes = HistoryBytes = ExitBytes = 0;
+    ProgressLastReported = 0;
+    bStoppedByWallTime = false;
+    SessionStartTime = std::chrono::steady_clock::now();
+
+    // continue from the checkpoint: the streams are positioned according to it, the results collected before it are restored
+    if (bResume) readCheckpoint();
+
     //populate particle collection
     prepareParticleCollection();
 
@@ -54,24 +107,91 @@ void SessionManager::startSession()
     // preparing ouptut for exiting particle export
     if (bExitParticles) prepareOutputExitStream();
 
-    //set random generator. The seed was provided in the config file
-    CLHEP::RanecuEngine* randGen = new CLHEP::RanecuEngine();
-    randGen->setSeed(Seed);
-    G4Random::setTheEngine(randGen);
+    // primaries of the events aborted by the watchdog
+    if (bEventLimits) prepareOutputAbortedStream();
 
     executeAdditionalCommands();
 
     findExitVolume();
+
+    bResume = false; // server mode: only the first job can be resumed
+}
+
+void SessionManager::initializeRandomGenerator()
+{
+    //set random generator. The engine and the seed were provided in the config file
+    CLHEP::HepRandomEngine * randGen = nullptr;
+    if      (RandomEngineName == "Ranecu")   randGen = new CLHEP::RanecuEngine();
+    else if (RandomEngineName == "MixMax")   randGen = new CLHEP::MixMaxRng();
+    else if (RandomEngineName == "Ranlux")   randGen = new CLHEP::RanluxEngine();
+    else if (RandomEngineName == "Ranlux64") randGen = new CLHEP::Ranlux64Engine();
+    else if (RandomEngineName == "MTwist")   randGen = new CLHEP::MTwistEngine();
+#ifdef GEANT_VERSION_FROM_11
+    else if (RandomEngineName == "Ranluxpp") randGen = new CLHEP::RanluxppEngine();
+#endif
+    if (!randGen) terminateSession("Unknown random engine: " + RandomEngineName);
+
+    G4Random::setTheEngine(randGen);
+    seedEngineStream(0);
+}
+
+// MT: the worker engines are of the same type, Geant4 seeds them for every event from the master engine
+// multi-process mode: the worker processes use streams 0, 1, 2, ...
+void SessionManager::seedEngineStream(uint64_t stream)
+{
+    CLHEP::HepRandomEngine * engine = G4Random::getTheEngine();
+
+    if (RandomEngineName == "MixMax")
+    {
+        // (Seed, stream) selects one of the MixMax streams which are guaranteed not to overlap
+        long seeds[4] = { (long)(Seed & 0xFFFFFFFF), (long)((Seed >> 32) & 0xFFFFFFFF),
+                          (long)(stream & 0xFFFFFFFF), (long)((stream >> 32) & 0xFFFFFFFF) };
+        engine->setSeeds(seeds, 4);
+    }
+    else if (RandomEngineName == "Ranecu" && stream < RanecuSeedTableSize)
+    {
+        // a different seed selects a different sequence from the Ranecu table of non-overlapping seeds
+        engine->setSeed(Seed + (long)stream, 0);
+    }
+    else
+    {
+        // zero-terminated pair of seeds valid for all CLHEP engines (Ranecu accepts 1..2147483562 and 1..2147483398)
+        const uint64_t key = mix64(mix64((uint64_t)Seed) ^ stream);
+        long seeds[3];
+        seeds[0] = 1 + (long)((key & 0xFFFFFFFFull) % 2147483562ull);
+        seeds[1] = 1 + (long)((key >> 32) % 2147483398ull);
+        seeds[2] = 0;
+        G4Random::setTheSeeds(seeds);
+    }
+}
+
+namespace
+{
+    thread_local bool bThrowOnTermination = false;
+}
+
+void SessionManager::throwOnTerminationInThisThread()
+{
+    bThrowOnTermination = true;
 }
 
 void SessionManager::terminateSession(const std::string & ReturnMessage)
 {
+    if (bThrowOnTermination) throw std::runtime_error(ReturnMessage);
+
     std::cout << "$$>"<<ReturnMessage<<std::endl;
 
     bError = true;
     ErrorMessage = ReturnMessage;
     generateReceipt();
 
+    if (bServerReady && ShardIndex < 0)
+    {
+        // the state left by the failed job is unknown: start over with the last good configuration and wait for the next job
+        bServerReady = false;
+        restartServer(ServerConfigFile, true);
+    }
+
     exit(0);
 }
 
@@ -80,171 +200,946 @@ void SessionManager::endSession()
     bError = false;
     ErrorMessage.clear();
 
+    closeStreams(); // before the receipt: it reports that the output is complete
+
+    // the checkpoint is kept only if the run was interrupted
+    if (bCheckpoint && !bStoppedByWallTime) std::remove(FileName_Checkpoint.data());
+
     storeMonitorsData();
 
+    if (!NextStageConfig.empty() && ShardIndex < 0)
+    {
+        // the exit particles of an interrupted run are incomplete: the next stage is started when --resume completes the run
+        if (bStoppedByWallTime) WarningMessages.push_back("Next stage is not started: the run was interrupted");
+        else runNextStage();
+    }
+
     generateReceipt();
 }
 
+void SessionManager::runNextStage()
+{
+    // the exit particle output is a file with primaries in the G4ants binary format: every event has its header, also the empty ones
+    std::ifstream file;
+    if (!bExitToMemory)
+    {
+        file.open(FileName_Exit, std::ios::in | std::ios::binary);
+        if (!file.is_open())
+        {
+            WarningMessages.push_back("Next stage: cannot open the exit particle file " + FileName_Exit);
+            return;
+        }
+    }
+    else if (ExitBuffer.empty())
+    {
+        WarningMessages.push_back("Next stage is not started: there are no events");
+        return;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        WarningMessages.push_back("Next stage: failed to create a pipe");
+        return;
+    }
+
+    // G4ants exits with 0 also on errors: the result of the next stage is taken from its receipt
+    std::string receiptFileName;
+    {
+        std::ifstream inConfig(NextStageConfig);
+        std::stringstream ss;
+        ss << inConfig.rdbuf();
+        std::string err;
+        receiptFileName = json11::Json::parse(ss.str(), err)["File_Receipt"].string_value();
+    }
+    if (!receiptFileName.empty()) std::remove(receiptFileName.data()); // of a previous run
+
+    const std::vector<std::string> args = {"G4ants", NextStageConfig, "--stage-input"};
+    std::vector<char*> argv;
+    for (const std::string & a : args) argv.push_back(const_cast<char*>(a.data()));
+    argv.push_back(nullptr);
+
+    std::cout << "Starting the next stage: " << NextStageConfig << std::endl << std::flush;
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]); close(fds[1]);
+        WarningMessages.push_back("Next stage: failed to start the process");
+        return;
+    }
+    if (pid == 0)
+    {
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]); close(fds[1]);
+        execv("/proc/self/exe", argv.data());
+        _exit(1);
+    }
+    close(fds[0]);
+
+    // if the next stage fails before reading everything, write() reports EPIPE instead of killing this process
+    const auto oldSigPipeHandler = signal(SIGPIPE, SIG_IGN);
+
+    auto writeAll = [fd = fds[1]](const char * data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t n = write(fd, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    };
+
+    bool ok = true;
+    if (bExitToMemory)
+    {
+        ok = writeAll(ExitBuffer.data(), ExitBuffer.size());
+        std::string().swap(ExitBuffer);
+    }
+    else
+    {
+        std::vector<char> buf(1 << 20);
+        while (ok && file)
+        {
+            file.read(buf.data(), buf.size());
+            ok = writeAll(buf.data(), file.gcount());
+        }
+    }
+    close(fds[1]);
+    signal(SIGPIPE, oldSigPipeHandler); // server mode: the next jobs run with the original handler
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    std::ifstream inReceipt(receiptFileName);
+    std::stringstream ss;
+    ss << inReceipt.rdbuf();
+    std::string err;
+    const json11::Json receipt = json11::Json::parse(ss.str(), err);
+
+    std::string error;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) error = "the process terminated abnormally";
+    else if (!err.empty())                              error = "no receipt";
+    else if (!receipt["Success"].bool_value())          error = receipt["Error"].string_value();
+    else if (!ok)                                       error = "not all exit particles were passed to it";
+
+    if (error.empty())
+    {
+        std::cout << "Next stage finished" << std::endl;
+        return;
+    }
+    bError = true;
+    ErrorMessage = "Next stage failed: " + error;
+    std::cout << "$$>" << ErrorMessage << std::endl;
+}
+
 void SessionManager::runSimulation()
 {
-    G4UImanager* UImanager = G4UImanager::GetUIpointer();
+    // the events of a pipe cannot be counted in advance and the shards cannot reopen it
+    if (NumProcesses > 1 && ShardIndex < 0 && !inPrimaries->isSeekable())
+    {
+        WarningMessages.push_back("Multi-process mode is not supported when the primaries are read from a pipe, running in one process");
+        NumProcesses = 1;
+    }
+    if (NumProcesses > 1 && ShardIndex < 0)
+    {
+        runShardedSimulation(); // only the parent process returns
+        return;
+    }
 
-    DepoByRegistered = 0;
-    DepoByNotRegistered = 0;
+    if (EstimateEvents > 0)
+    {
+        if (!inPrimaries->isSeekable()) terminateSession("Estimate mode requires a file with primaries, not a pipe");
+        prepareEstimate(); // only a random sample of the events is simulated
+    }
 
-    EventsDone = 0;
-    ProgressLastReported = 0;
+    ProgressInc = 1.0;
     if (NumEventsToDo != 0)
         ProgressInc = 100.0 / NumEventsToDo;
 
+    // all events are processed in a single run: the number of events is not known in advance,
+    // so the run is requested to be "infinite" and EventAction aborts it (soft) after the last event in the file
+    // in MT mode every worker aborts its own run when the input is exhausted
+    // task-based mode splits the run into tasks of NumEvents/GrainSize events, so the number of events has to be finite:
+    // the events are requested in runs of NumEvents (from config) until the input is exhausted
+    // checkpoints are written between the runs, when all events of the run are written and the monitors are merged
+    int eventsPerRun = std::numeric_limits<int>::max();
+    if (bTasking) eventsPerRun = (NumEventsToDo > 0 ? NumEventsToDo : DefaultEventsPerTaskRun);
+    if (bCheckpoint) eventsPerRun = CheckpointEvents;
+
+    // task-based mode with a file: a run is not larger than the rest of the input, so no tasks are made for events which do not exist
+    // (pipes cannot be counted, there the last run ends with empty events)
+    long eventsInInput = -1;
+    const long eventsReadAtStart = EventsRead;
+    if (bTasking && inPrimaries->isSeekable())
+        eventsInInput = (SampleEvents.empty() ? countEventsInInput() : (long)SampleEvents.size());
+
     while (!isEndOfInputFileReached())
-        UImanager->ApplyCommand("/run/beamOn");
+    {
+        int runSize = eventsPerRun;
+        if (eventsInInput >= 0)
+        {
+            long remaining = (SampleEvents.empty() ? eventsInInput - (EventsRead - eventsReadAtStart) : (long)(SampleEvents.size() - NextSampleEvent));
+            remaining *= std::max(1, RecycleTimes); // every copy is a Geant4 event
+            if (!SplitPrimaries.empty())
+            {
+                // the rest of the current copy, then the whole copies left
+                const size_t copyEnd = (SplitNextPrimary / SplitCopySize + 1) * SplitCopySize;
+                remaining += (copyEnd - SplitNextPrimary + SplitSize - 1) / SplitSize;
+                remaining += (SplitPrimaries.size() - copyEnd) / SplitCopySize * ((SplitCopySize + SplitSize - 1) / SplitSize);
+            }
+            runSize = (int)std::max(1L, std::min<long>(eventsPerRun, remaining));
+        }
+
+        const long handedOut = EventsHandedOut;
+        G4RunManager::GetRunManager()->BeamOn(runSize);
+        if (EventsHandedOut == handedOut) break; // run did not start
+        if (bCheckpoint) writeCheckpoint();
+    }
+
+    if (bStoppedByWallTime)
+        std::cout << "Wall-clock limit reached after " << EventsDone << " events" << std::endl;
+
+    if (EstimateEvents > 0) reportEstimate();
 }
 
-void SessionManager::onRunFinished()
+void SessionManager::setEstimateMode(int numSampleEvents)
+{
+    EstimateEvents = numSampleEvents;
+
+    // the output is only counted
+    FileName_Output   = "/dev/null";
+    FileName_Tracks   = "/dev/null";
+    FileName_Exit     = "/dev/null";
+    FileName_Monitors = "/dev/null";
+    FileName_Aborted  = "/dev/null";
+    bCheckpoint  = false;
+    NumProcesses = 1;
+    NextStageConfig.clear();
+    bExitToMemory = false;
+}
+
+void SessionManager::prepareEstimate()
+{
+    const long numEvents = countEventsInInput();
+    EstimateTotalEvents = (NumEventsToDo > 0 ? NumEventsToDo : numEvents);
+    const long numSample = std::min<long>(EstimateEvents, numEvents);
+
+    // Floyd's algorithm: numSample distinct event indexes
+    std::mt19937_64 gen(Seed);
+    std::unordered_set<long> selected;
+    for (long j = numEvents - numSample; j < numEvents; j++)
+    {
+        const long t = std::uniform_int_distribution<long>(0, j)(gen);
+        if (!selected.insert(t).second) selected.insert(j);
+    }
+    SampleEvents.assign(selected.begin(), selected.end());
+    std::sort(SampleEvents.begin(), SampleEvents.end());
+    NextSampleEvent = 0;
+
+    std::cout << "Estimate: simulating " << numSample << " randomly selected events of " << numEvents << std::endl;
+    NumEventsToDo = numSample;
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage); // all threads
+    EstimateCpuStart  = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    EstimateWallStart = std::chrono::steady_clock::now();
+}
+
+void SessionManager::reportEstimate()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const double cpu  = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) - EstimateCpuStart;
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - EstimateWallStart).count();
+    const double num  = std::max(1, EventsDone);
+    const double scale = EstimateTotalEvents / num;
+
+    json11::Json::object est;
+    est["SampledEvents"]     = EventsDone;
+    est["TotalEvents"]       = (double)EstimateTotalEvents;
+    est["CpuTimePerEvent"]   = cpu / num;         // s
+    est["ProjectedCpuTime"]  = cpu * scale;
+    est["ProjectedWallTime"] = wall * scale;
+    est["PeakMemoryMB"]      = usage.ru_maxrss / 1024.0; // ru_maxrss is in kB, includes the initialization
+
+    std::cout << "Estimate for " << EstimateTotalEvents << " events (from " << EventsDone << " sampled):" << std::endl;
+    std::cout << "  CPU time:  " << cpu * scale << " s (" << cpu / num << " s per event)" << std::endl;
+    std::cout << "  Wall time: " << wall * scale << " s" << std::endl;
+
+    // the size of the history output is capped by MaxTracks, which the linear projection does not take into account
+    const std::pair<const char*, long> streams[] = { {"Deposition", (outStreamDeposition ? DepositionBytes : -1)},
+                                                     {"History",    (outStreamHistory    ? HistoryBytes    : -1)},
+                                                     {"Exit",       (outStreamExit       ? ExitBytes       : -1)} };
+    for (const auto & st : streams)
+    {
+        if (st.second < 0) continue; // stream is not enabled
+        est[std::string(st.first) + "BytesPerEvent"]  = st.second / num;
+        est[std::string(st.first) + "ProjectedBytes"] = st.second * scale;
+        std::cout << "  " << st.first << " output: " << st.second * scale << " bytes (" << st.second / num << " per event)" << std::endl;
+    }
+    std::cout << "  Peak memory: " << usage.ru_maxrss / 1024.0 << " MB" << std::endl;
+
+    EstimateReport = est;
+}
+
+void SessionManager::runShardedSimulation()
+{
+    // geometry, physics and /run/initialize are already done: the workers share them copy-on-write
+    const long numEvents = countEventsInInput();
+    const int  numShards = (int)std::max(1L, std::min<long>(NumProcesses, numEvents));
+
+    // the shards open their own readers; the reader thread of the prefetch would not survive fork
+    delete inPrimaries; inPrimaries = nullptr;
+    delete inIndex;     inIndex     = nullptr;
+    std::cout << "Sharding " << numEvents << " events over " << numShards << " processes" << std::endl;
+
+    std::vector<pid_t> pids;
+    long firstEvent = 0;
+    for (int iShard = 0; iShard < numShards; iShard++)
+    {
+        const long num = numEvents / numShards + (iShard < numEvents % numShards ? 1 : 0);
+
+        std::cout << std::flush;
+        const pid_t pid = fork();
+        if (pid < 0) terminateSession("Failed to start a worker process");
+        if (pid == 0) runShard(iShard, firstEvent, num); // does not return
+
+        pids.push_back(pid);
+        firstEvent += num;
+    }
+
+    for (const pid_t pid : pids)
+    {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status))
+            WarningMessages.push_back("Worker process terminated abnormally");
+    }
+
+    mergeShards(numShards);
+}
+
+void SessionManager::runShard(int iShard, long firstEvent, long numEvents)
+{
+    ShardIndex = iShard;
+
+    // the file descriptors are shared with the parent: reopen the input, the opened outputs are reserved for the merged data
+    closeStreams();
+
+    FileName_Output   = makeShardFileName(FileName_Output,   iShard);
+    FileName_Tracks   = makeShardFileName(FileName_Tracks,   iShard);
+    FileName_Exit     = makeShardFileName(FileName_Exit,     iShard);
+    FileName_Aborted  = makeShardFileName(FileName_Aborted,  iShard);
+    FileName_Monitors = makeShardFileName(FileName_Monitors, iShard);
+    FileName_Receipt  = makeShardFileName(FileName_Receipt,  iShard);
+
+    prepareInputStream();
+    prepareOutputDepoStream();
+    if (CollectHistory != NotCollecting) prepareOutputHistoryStream();
+    if (bExitParticles) prepareOutputExitStream();
+    if (bEventLimits) prepareOutputAbortedStream();
+
+    skipEvents(firstEvent);
+    MaxEventsToRead = numEvents;
+
+    seedEngineStream(iShard);
+
+    // progress is reported only by the first worker
+    NumEventsToDo = numEvents;
+    bReportProgress = (iShard == 0);
+
+    runSimulation();
+    endSession();
+
+    std::cout << std::flush;
+    _exit(0);
+}
+
+std::string SessionManager::makeShardFileName(const std::string & fileName, int iShard) const
+{
+    if (fileName.empty()) return fileName;
+    return fileName + ".shard" + std::to_string(iShard);
+}
+
+void SessionManager::mergeShards(int numShards)
+{
+    std::string error;
+
+    for (int iShard = 0; iShard < numShards; iShard++)
+    {
+        // receipt
+        const std::string receiptFileName = makeShardFileName(FileName_Receipt, iShard);
+        std::ifstream inReceipt(receiptFileName);
+        std::stringstream ss;
+        ss << inReceipt.rdbuf();
+        inReceipt.close();
+        std::remove(receiptFileName.data());
+
+        std::string err;
+        json11::Json receipt = json11::Json::parse(ss.str(), err);
+        if (!err.empty() || !receipt["Success"].bool_value())
+        {
+            if (error.empty())
+                error = "Worker process #" + std::to_string(iShard) + " failed: " + (err.empty() ? receipt["Error"].string_value() : "no receipt");
+            continue;
+        }
+        DepoByRegistered    += receipt["DepoByRegistered"].number_value();
+        DepoByNotRegistered += receipt["DepoByNotRegistered"].number_value();
+        EventsDone          += receipt["EventsDone"].int_value();
+        EventsAborted       += receipt["EventsAborted"].int_value();
+        if (receipt["Interrupted"].is_string()) bStoppedByWallTime = true;
+        for (const json11::Json & j : receipt["SeenNotRegisteredParticles"].array_items())
+            SeenNotRegisteredParticles.insert(j.string_value());
+
+        // output files, shards are consecutive blocks of events
+        appendShardFile(outStreamDeposition, makeShardFileName(FileName_Output, iShard));
+        appendShardFile(outStreamHistory,    makeShardFileName(FileName_Tracks, iShard));
+        appendShardFile(outStreamExit,       makeShardFileName(FileName_Exit,   iShard));
+        appendShardFile(outStreamAborted,    makeShardFileName(FileName_Aborted, iShard));
+
+        // monitors
+        if (!FileName_Monitors.empty())
+        {
+            const std::string monFileName = makeShardFileName(FileName_Monitors, iShard);
+            std::ifstream inMon(monFileName);
+            std::stringstream ssMon;
+            ssMon << inMon.rdbuf();
+            inMon.close();
+            std::remove(monFileName.data());
+
+            json11::Json jsMon = json11::Json::parse(ssMon.str(), err);
+            const std::vector<json11::Json> & arMon = jsMon.array_items();
+            for (size_t i = 0; i < arMon.size() && i < Monitors.size(); i++)
+                Monitors[i]->mergeFromJson(arMon[i]);
+        }
+    }
+
+    if (!error.empty()) terminateSession(error);
+}
+
+void SessionManager::appendShardFile(std::ofstream * out, const std::string & fileName)
+{
+    if (!out) return;
+
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    if (in.is_open() && in.peek() != std::ifstream::traits_type::eof())
+        *out << in.rdbuf();
+    in.close();
+    std::remove(fileName.data());
+}
+
+long SessionManager::countEventsInInput()
+{
+    if (!inPrimaries || inPrimaries->isExhausted()) return 0;
+
+    const long pos = inPrimaries->getPosition();
+    long num = -1;
+
+    const long iEvent = (inIndex ? inIndex->findEvent(pos) : -1);
+    if (iEvent >= 0) num = inIndex->size() - iEvent;
+    else
+    {
+        const std::string firstEventId = inPrimaries->NextEventId;
+        const long firstLine = inPrimaries->getLineNumber();
+
+        num = 1; // the header of the first event is already read
+        while (inPrimaries->skipEvent()) num++;
+
+        inPrimaries->setPosition(pos, firstEventId, firstLine);
+    }
+
+    if (MaxEventsToRead >= 0) num = std::min(num, MaxEventsToRead - EventsRead);
+    return num;
+}
+
+void SessionManager::skipEvents(long num)
+{
+    if (num <= 0 || inPrimaries->isExhausted()) return;
+
+    const long iEvent = (inIndex ? inIndex->findEvent(inPrimaries->getPosition()) : -1);
+    if (iEvent < 0)
+    {
+        for (long i = 0; i < num; i++)
+            inPrimaries->skipEvent();
+        return;
+    }
+
+    // beyond the last event: position at the last one and skip it
+    const long iTarget = std::min(iEvent + num, inIndex->size() - 1);
+    const PrimariesIndex::Entry e = inIndex->getEntry(iTarget);
+    inPrimaries->setPosition(e.Position, inIndex->getEventId(e), e.LineNumber);
+    if (iTarget < iEvent + num) inPrimaries->skipEvent();
+}
+
+void SessionManager::buildInputIndex()
+{
+    if (bPrimarySource) terminateSession("Nothing to index: the primaries are generated by the built-in source");
+    PrimariesReader * reader = openPrimariesReader();
+    std::cout << "Indexing " << FileName_Input << std::endl;
+    const long num = PrimariesIndex::build(*reader, FileName_Input);
+    delete reader;
+    std::cout << "Indexed " << num << " events: " << PrimariesIndex::makeFileName(FileName_Input) << std::endl;
+}
+
+void SessionManager::configureServer(const std::string & fifoName, const std::string & configFileName)
+{
+    ServerFifo = fifoName;
+    ServerConfigFile = configFileName;
+}
+
+void SessionManager::runServer()
+{
+    struct stat st;
+    if (stat(ServerFifo.data(), &st) != 0)
+    {
+        if (mkfifo(ServerFifo.data(), 0600) != 0) terminateSession("Cannot create server fifo " + ServerFifo);
+    }
+    else if (!S_ISFIFO(st.st_mode)) terminateSession(ServerFifo + " exists and is not a fifo");
+
+    RunningSetup = makeServerSetup();
+    bServerReady = true;
+    std::cout << "Server is waiting for jobs on " << ServerFifo << std::endl;
+
+    // every line written to the fifo is the name of a config file (same format as for a single run), "quit" stops the server
+    std::string configFileName;
+    while (readServerJob(configFileName))
+    {
+        if (configFileName == "quit") break;
+        runServerJob(configFileName);
+    }
+
+    bServerReady = false;
+    if (ServerFd >= 0) close(ServerFd);
+    ServerFd = -1;
+}
+
+bool SessionManager::readServerJob(std::string & configFileName)
+{
+    // unbuffered: the jobs still in the fifo have to survive a restart of the server
+    configFileName.clear();
+    while (true)
+    {
+        if (ServerFd < 0)
+        {
+            ServerFd = open(ServerFifo.data(), O_RDONLY | O_CLOEXEC); // blocks until a client opens the fifo for writing
+            if (ServerFd < 0)
+            {
+                if (errno == EINTR) continue;
+                return false;
+            }
+        }
+
+        char ch;
+        const ssize_t n = read(ServerFd, &ch, 1);
+        if (n == 1)
+        {
+            if (ch != '\n' && ch != '\r') configFileName += ch;
+            else if (!configFileName.empty()) return true;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+
+        // all clients closed the fifo
+        close(ServerFd);
+        ServerFd = -1;
+        if (!configFileName.empty()) return true;
+        if (n < 0) return false;
+    }
+}
+
+void SessionManager::runServerJob(const std::string & configFileName)
+{
+    std::cout << "Server job: " << configFileName << std::endl;
+
+    ReadConfig(configFileName);
+    if (!RunningSetup.covers(makeServerSetup()))
+    {
+        // Geant4 cannot replace the physics list and the thread setup after initialization
+        std::cout << "Geometry, physics or thread configuration has changed: restarting the server" << std::endl;
+        bServerReady = false;
+        restartServer(configFileName, false);
+        terminateSession("Failed to restart the server");
+    }
+
+    seedEngineStream(0); // MT: the workers are seeded from the master engine at the start of every run
+    startSession();
+    runSimulation();
+    endSession();
+
+    ServerConfigFile = configFileName;
+    std::cout << "Server job finished" << std::endl;
+}
+
+void SessionManager::restartServer(const std::string & configFileName, bool bIdle)
+{
+    // the new process starts with the given config and then reads the next jobs from the same fifo
+    std::vector<std::string> args = {"G4ants", configFileName, "--server", ServerFifo};
+    if (bIdle) args.push_back("--idle");
+
+    std::vector<char*> argv;
+    for (std::string & a : args) argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+
+    std::cout << std::flush;
+    execv("/proc/self/exe", argv.data());
+    std::cout << "Failed to restart the server" << std::endl;
+}
+
+SessionManager::ServerSetup SessionManager::makeServerSetup() const
+{
+    ServerSetup setup;
+
+    setup.GDML = GDML;
+    struct stat st;
+    if (stat(GDML.data(), &st) == 0) setup.GDMLModified = st.st_mtime;
+
+    setup.PhysicsList        = PhysicsList;
+    setup.RandomEngine       = RandomEngineName;
+    setup.bThermalScattering = bUseThermalScatteringNeutronPhysics;
+    setup.NumThreads         = NumThreads;
+    setup.bTasking           = bTasking;
+    setup.TaskGrainSize      = TaskGrainSize;
+    setup.SensitiveVolumes   = SensitiveVolumes;
+    setup.StepLimitMap       = StepLimitMap;
+    setup.MaterialsToOverrideWithStandard = MaterialsToOverrideWithStandard;
+    setup.MonitorNames       = MonitorNames;
+
+    // see ActionInitialization::Build()
+    setup.bSteppingAction = (CollectHistory != NotCollecting || bMonitorsRequireSteppingAction || bExitParticles || bEventLimits);
+    setup.bTrackingAction = (CollectHistory != NotCollecting);
+
+    return setup;
+}
+
+bool SessionManager::ServerSetup::covers(const ServerSetup & job) const
+{
+    if (GDML != job.GDML || GDMLModified != job.GDMLModified) return false;
+    if (PhysicsList != job.PhysicsList || bThermalScattering != job.bThermalScattering) return false;
+    if (RandomEngine != job.RandomEngine) return false; // MT: the master engine is registered in the run manager
+    if (NumThreads != job.NumThreads || bTasking != job.bTasking || TaskGrainSize != job.TaskGrainSize) return false;
+    if (SensitiveVolumes != job.SensitiveVolumes || StepLimitMap != job.StepLimitMap) return false;
+    if (MaterialsToOverrideWithStandard != job.MaterialsToOverrideWithStandard) return false;
+    if (MonitorNames != job.MonitorNames) return false;
+
+    // the user actions check the configuration at runtime: a missing one is the only problem
+    if (job.bSteppingAction && !bSteppingAction) return false;
+    if (job.bTrackingAction && !bTrackingAction) return false;
+
+    return true;
+}
+
+namespace
+{
+    G4ThreadLocal SessionContext * ThreadContext = nullptr;
+}
+
+SessionContext & SessionManager::getContext()
+{
+    if (!ThreadContext)
+    {
+        ThreadContext = new SessionContext(G4Threading::G4GetThreadId(), CollectHistory);
+
+        std::lock_guard<std::mutex> lock(ContextMutex);
+        Contexts.push_back(ThreadContext);
+    }
+    return *ThreadContext;
+}
+
+void SessionManager::onEventStarted()
 {
-    updateEventId();
+    SessionContext & C = getContext();
+    C.EventSteps    = 0;
+    C.EventTracks   = 0;
+    C.bEventAborted = false;
+    if (MaxCpuTimePerEvent > 0) C.EventCpuStart = getThreadCpuTime();
+
+    writeNewEventMarker();
+}
+
+void SessionManager::abortEvent(const std::string & reason)
+{
+    SessionContext & C = getContext();
+    C.bEventAborted = true;
+    G4RunManager::GetRunManager()->AbortEvent(); // the output collected so far is dropped in onEventFinished
+
+    std::lock_guard<std::mutex> lock(OutputMutex);
+    EventsAborted++;
+    std::cout << "Event " << C.EventId << " aborted: " << reason << std::endl;
+
+    // the log can be used directly as a file with primaries (G4ants text format) to replay the events
+    if (!outStreamAborted) return;
+    std::ofstream & out = *outStreamAborted;
+    out << C.EventId << '\n';
+    for (const ParticleRecord & r : C.Primaries)
+    {
+        out << r.Particle->GetParticleName() << ' ' << r.Energy << ' '
+            << r.Position[0]  << ' ' << r.Position[1]  << ' ' << r.Position[2]  << ' '
+            << r.Direction[0] << ' ' << r.Direction[1] << ' ' << r.Direction[2] << ' '
+            << r.Time;
+        if (r.Weight != 1.0) out << ' ' << r.Weight;
+        out << '\n';
+    }
+    out.flush();
+}
+
+double SessionManager::getThreadCpuTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void SessionManager::onEventFinished()
+{
+    SessionContext & C = getContext();
+    C.NextTrackID = 1;
+
+    if (C.EventIndex < 0) return; // input was already exhausted when this event started
+
+    if (C.bEventAborted)
+    {
+        // partial output would look like a complete event: only the event marker is kept (the primaries are in the log of the aborted events)
+        C.DepoStream.str(std::string());
+        C.HistoryStream.str(std::string());
+        C.ExitStream.str(std::string());
+        writeNewEventMarker();
+    }
+
+    flushEventOutput(C);
+    C.EventIndex = -1;
+}
+
+void SessionManager::flushEventOutput(SessionContext & C)
+{
+    EventOutput out;
+    out.bNewEvent  = (C.SubEventIndex == 0);
+    out.Deposition = C.DepoStream.str();    C.DepoStream.str(std::string());
+    out.History    = C.HistoryStream.str(); C.HistoryStream.str(std::string());
+    out.Exit       = C.ExitStream.str();    C.ExitStream.str(std::string());
+
+    std::lock_guard<std::mutex> lock(OutputMutex);
+
+    if (C.EventIndex != NextEventToWrite)
+    {
+        // events finished out of order (MT): keep until all preceding events are written
+        PendingOutput.emplace(C.EventIndex, std::move(out));
+        return;
+    }
+
+    writeEventOutput(out);
+    NextEventToWrite++;
+
+    auto it = PendingOutput.begin();
+    while (it != PendingOutput.end() && it->first == NextEventToWrite)
+    {
+        writeEventOutput(it->second);
+        NextEventToWrite++;
+        it = PendingOutput.erase(it);
+    }
+}
+
+void SessionManager::writeEventOutput(const EventOutput & out)
+{
+    DepositionBytes += out.Deposition.size();
+    HistoryBytes    += out.History.size();
+    ExitBytes       += out.Exit.size();
+
+    if (outStreamDeposition) outStreamDeposition->write(out.Deposition.data(), out.Deposition.size());
+    if (outStreamHistory)    outStreamHistory->write(out.History.data(), out.History.size());
+    if (outStreamExit)       outStreamExit->write(out.Exit.data(), out.Exit.size());
+    if (bExitToMemory)       ExitBuffer += out.Exit;
+
+    if (!out.bNewEvent) return; // sub-event of an already counted event
 
     EventsDone++;
     double Progress = (double)EventsDone * ProgressInc;
-    if (Progress - ProgressLastReported > 1.0) //1% intervales
+    if (bReportProgress && Progress - ProgressLastReported > 1.0) //1% intervales
     {
         std::cout << "$$progress>" << (int)Progress << "<$$"<< std::endl << std::flush;
         ProgressLastReported = Progress;
     }
 }
 
-void SessionManager::updateEventId()
+void SessionManager::onRunFinished()
+{
+    std::lock_guard<std::mutex> lock(ContextMutex);
+
+    // merge in the order of thread ids to make the result independent of the thread scheduling
+    std::vector<SessionContext*> sorted = Contexts;
+    std::sort(sorted.begin(), sorted.end(), [](const SessionContext * a, const SessionContext * b){return a->ThreadId < b->ThreadId;});
+
+    for (SessionContext * C : sorted)
+    {
+        DepoByRegistered    += C->DepoByRegistered;    C->DepoByRegistered = 0;
+        DepoByNotRegistered += C->DepoByNotRegistered; C->DepoByNotRegistered = 0;
+
+        SeenNotRegisteredParticles.insert(C->SeenNotRegisteredParticles.begin(), C->SeenNotRegisteredParticles.end());
+        C->SeenNotRegisteredParticles.clear();
+
+        for (size_t i = 0; i < C->Monitors.size() && i < Monitors.size(); i++)
+        {
+            if (C->Monitors[i] == Monitors[i]) continue; // sequential mode: the monitors are used directly
+            Monitors[i]->merge(*C->Monitors[i]);
+            C->Monitors[i]->clearData();
+        }
+    }
+}
+
+bool SessionManager::onTrackBuilt()
 {
-    EventId = NextEventId;
+    return (--TracksToBuild > 0);
 }
 
 std::vector<ParticleRecord> &SessionManager::getNextEventPrimaries()
 {
-    GeneratedPrimaries.clear();
+    SessionContext & C = getContext();
+    C.Primaries.clear();
+    C.EventIndex = -1;
+    C.SubEventIndex = 0;
+
+    std::lock_guard<std::mutex> lock(InputMutex);
 
-    if (bG4antsPrimaries)
+    if (isInputExhausted()) return C.Primaries;
+
+    if (SplitPrimaries.empty())
     {
-        if (bBinaryPrimaries)
+        // estimate mode: the events which are not in the sample are skipped
+        if (!SampleEvents.empty())
         {
-            int eventId;
-            std::string pn;
-            char ch;
-            while (inStreamPrimaries->get(ch))
-            {
-                if (inStreamPrimaries->eof()) break;
-
-                if (ch == (char)0xEE)
-                {
-                    inStreamPrimaries->read((char*)&eventId, sizeof(int));
-                    NextEventId = '#' + std::to_string(eventId);
-                    break; //event finished
-                }
-                else if (ch == (char)0xFF)
-                {
-                    pn.clear();
-                    while (inStreamPrimaries->get(ch))
-                    {
-                        if (ch == (char)0x00) break;
-                        pn += ch;
-                    }
-
-                    ParticleRecord r;
-                    r.Particle = findGeant4Particle(pn); // terminates session if not found
-                    inStreamPrimaries->read((char*)&r.Energy,       sizeof(double));
-                    inStreamPrimaries->read((char*)&r.Position[0],  sizeof(double));
-                    inStreamPrimaries->read((char*)&r.Position[1],  sizeof(double));
-                    inStreamPrimaries->read((char*)&r.Position[2],  sizeof(double));
-                    inStreamPrimaries->read((char*)&r.Direction[0], sizeof(double));
-                    inStreamPrimaries->read((char*)&r.Direction[1], sizeof(double));
-                    inStreamPrimaries->read((char*)&r.Direction[2], sizeof(double));
-                    inStreamPrimaries->read((char*)&r.Time,         sizeof(double));
-
-                    //std::cout << pn << " -> " << r.Particle->GetParticleName() << " time="<< r.Time << std::endl;
-
-                    GeneratedPrimaries.push_back(r);
-                }
-            }
+            skipEvents(SampleEvents[NextSampleEvent] - EventsRead);
+            EventsRead = SampleEvents[NextSampleEvent];
+            NextSampleEvent++;
         }
-        else
+
+        // the wall-clock limit stops the simulation at an event boundary
+        if (MaxWallTime > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - SessionStartTime).count() > MaxWallTime)
         {
-            for( std::string line; getline( *inStreamPrimaries, line ); )
-            {
-                //std::cout << line << std::endl;
-                if (line.size() < 1) continue; //allow empty lines
-
-                if (line[0] == '#')
-                {
-                    NextEventId = line;
-                    break; //event finished
-                }
-
-                ParticleRecord r;
-                std::string particleName;
-                std::stringstream ss(line);
-                ss >> particleName
-                   >> r.Energy >> r.Position[0] >> r.Position[1]  >> r.Position[2]
-                   >> r.Direction[0] >> r.Direction[1] >> r.Direction[2]
-                   >> r.Time;
-/*
-                int numRead = std::sscanf(line.data(), "%s %lf %lf %lf %lf %lf %lf %lf %lf",
-                                          &particleName,
-                                          &r.Energy,
-                                          &r.Position[0],  &r.Position[1],  &r.Position[2],
-                                          &r.Direction[0], &r.Direction[1], &r.Direction[2],
-                                          &r.Time);
-                if (numRead != 9)
-                    terminateSession("Unexpected format of file with primaries");
-                */
+            bStoppedByWallTime = true;
+            return C.Primaries;
+        }
 
-                r.Particle = findGeant4Particle(particleName); // terminates session if not found
+        C.EventId = inPrimaries->NextEventId;
+        inPrimaries->readEvent(C.Primaries);
+        EventsRead++;
 
-                //std::cout << particleName << " -> " << r.Particle->GetParticleName() << " time="<< r.Time << std::endl;
+        // the output of the sub-events is written consecutively under the marker of the original event
+        const size_t eventSize = C.Primaries.size();
+        if (RecycleTimes > 1 && eventSize > 0)
+        {
+            // phase-space recycling: the copies of the event are sub-events, each with its own transform and random engine state
+            recyclePrimaries(C.EventId, C.Primaries);
+            C.Primaries.clear();
+            SplitSize     = (MaxPrimariesPerEvent > 0 ? std::min<size_t>(MaxPrimariesPerEvent, eventSize) : eventSize);
+            SplitCopySize = eventSize;
+        }
+        else if (MaxPrimariesPerEvent > 0 && eventSize > (size_t)MaxPrimariesPerEvent)
+        {
+            // oversized event: it is split into sub-events which can be simulated by different threads
+            SplitPrimaries.swap(C.Primaries);
+            SplitSize     = MaxPrimariesPerEvent;
+            SplitCopySize = eventSize;
+        }
 
-                GeneratedPrimaries.push_back(r);
-            }
+        if (!SplitPrimaries.empty())
+        {
+            SplitEventId = C.EventId;
+            SplitNextPrimary = 0;
+            SplitNextSubEvent = 0;
         }
     }
-    else
+
+    if (!SplitPrimaries.empty())
     {
-        for( std::string line; getline( *inStreamPrimaries, line ); )
-        {
-            //std::cout << line << std::endl;
-            if (line.size() < 1) continue; //allow empty lines
+        const size_t from    = SplitNextPrimary;
+        const size_t copyEnd = (from / SplitCopySize + 1) * SplitCopySize; // a recycled copy is split on its own
+        const size_t to      = std::min(from + SplitSize, copyEnd);
+        C.Primaries.assign(SplitPrimaries.begin() + from, SplitPrimaries.begin() + to);
+        C.EventId       = SplitEventId;
+        C.SubEventIndex = SplitNextSubEvent++;
+
+        SplitNextPrimary = to;
+        if (SplitNextPrimary == SplitPrimaries.size()) SplitPrimaries.clear();
+    }
 
-            if (line[0] == '#')
-            {
-                NextEventId = line;
-                break; //event finished
-            }
+    C.EventIndex = EventsHandedOut++;
+    return C.Primaries;
+}
+
+void SessionManager::recyclePrimaries(const std::string & eventId, const std::vector<ParticleRecord> & primaries)
+{
+    const uint64_t iEvent = (uint64_t)getEventNumber(eventId);
+
+    SplitPrimaries.clear();
+    SplitPrimaries.reserve(primaries.size() * RecycleTimes);
+    for (int copy = 0; copy < RecycleTimes; copy++)
+    {
+        // the transform depends only on (Seed, event ID, copy): independent of the threads and the shards
+        PrimarySource::Random rnd(mix64(mix64((uint64_t)Seed ^ mix64(iEvent)) ^ (uint64_t)copy));
+        const double phi     = (bRecycleRotate ? 2.0 * M_PI * rnd.uniform() : 0);
+        const bool   bMirror = (bRecycleMirror && rnd.uniform() < 0.5);
+        const double cosPhi  = std::cos(phi);
+        const double sinPhi  = std::sin(phi);
+
+        // rotation about the axis (Rodrigues' formula), then the reflection
+        auto transform = [&](const G4ThreeVector & v)
+        {
+            G4ThreeVector t = v * cosPhi + RecycleAxis.cross(v) * sinPhi + RecycleAxis * (RecycleAxis.dot(v) * (1.0 - cosPhi));
+            if (bMirror) t = t - RecycleAxis * (2.0 * RecycleAxis.dot(t));
+            return t;
+        };
 
-            ParticleRecord r;
-            int Id;
-            int numRead = std::sscanf(line.data(), "%d %lf %lf %lf %lf %lf %lf %lf %lf",
-                                      &Id,
-                                      &r.Energy,
-                                      &r.Position[0],  &r.Position[1],  &r.Position[2],
-                                      &r.Direction[0], &r.Direction[1], &r.Direction[2],
-                                      &r.Time);
-            if (numRead != 9)
-                terminateSession("Unexpected format of file with primaries");
-
-            if (Id >= 0 || Id < (int)ParticleCollection.size() )
-                r.Particle = ParticleCollection[Id];
-            if (!r.Particle)
-                terminateSession("Use of unknown particle index");
-
-            GeneratedPrimaries.push_back( r );
+        for (const ParticleRecord & r : primaries)
+        {
+            SplitPrimaries.push_back(r);
+            ParticleRecord & t = SplitPrimaries.back();
+            t.Position  = RecycleCenter + transform(r.Position - RecycleCenter);
+            t.Direction = transform(r.Direction);
+            t.Weight    = r.Weight / RecycleTimes;
         }
     }
+}
+
+void SessionManager::seedEventRandomEngine()
+{
+    // recycled copies are always seeded per event: otherwise the state of a copy would depend on the thread which simulates it
+    if (!bPerEventSeeding && RecycleTimes <= 1) return;
+
+    SessionContext & C = getContext();
+    if (C.EventIndex < 0) return; // input is exhausted
 
-    return GeneratedPrimaries;
+    // the state is a function of the event only: independent of the thread count, shard layout and event order
+    // the stream index is a hash: it does not clash with the small indexes of the process streams
+    const uint64_t iEvent = (uint64_t)getEventNumber(C.EventId);
+    seedEngineStream(mix64(mix64(iEvent) ^ (uint64_t)C.SubEventIndex) | (1ull << 63)); // thread-local engine in MT mode
 }
 
-bool SessionManager::isEndOfInputFileReached() const
+long long SessionManager::getEventNumber(const std::string & eventId)
 {
-    if (!inStreamPrimaries) return true;
-    return inStreamPrimaries->eof();
+    // the text formats accept any header after '#': text after the number is ignored
+    long long number = 0;
+    const char * begin = eventId.data() + (eventId.empty() ? 0 : 1); // kill leading '#'
+    const std::from_chars_result res = std::from_chars(begin, eventId.data() + eventId.size(), number);
+    if (res.ec != std::errc()) terminateSession("Event header without a number: " + eventId);
+    return number;
+}
+
+bool SessionManager::isEndOfInputFileReached()
+{
+    std::lock_guard<std::mutex> lock(InputMutex);
+    return isInputExhausted();
+}
+
+bool SessionManager::isInputExhausted() const
+{
+    if (!SplitPrimaries.empty()) return false;
+    if (bStoppedByWallTime) return true;
+    if (!SampleEvents.empty() && NextSampleEvent >= SampleEvents.size()) return true;
+    if (!inPrimaries) return true;
+    if (MaxEventsToRead >= 0 && EventsRead >= MaxEventsToRead) return true;
+    return inPrimaries->isExhausted();
 }
 
 int SessionManager::findParticle(const std::string & particleName)
@@ -253,7 +1148,7 @@ int SessionManager::findParticle(const std::string & particleName)
     if (it == ParticleMap.end())
     {
         //terminateSession("Found deposition by particle not listed in the config json: " + particleName);
-        SeenNotRegisteredParticles.insert(particleName);
+        getContext().SeenNotRegisteredParticles.insert(particleName);
         return -1;
     }
 
@@ -566,59 +1461,70 @@ void SessionManager::updateMaterials(G4VPhysicalVolume * worldPV)
 
 void SessionManager::writeNewEventMarker()
 {
+    SessionContext & C = getContext();
+    if (C.EventIndex < 0) return; // no event: input is exhausted
+    if (C.SubEventIndex > 0) return; // the marker was written by the first sub-event
+
+    const std::string & EventId = C.EventId;
     const int iEvent = std::stoi( EventId.substr(1) );  // kill leading '#'
 
     if (outStreamDeposition)
     {
+        std::ostringstream & depo = C.DepoStream;
         if (bBinaryOutput)
         {
-            *outStreamDeposition << char(0xEE);
-             outStreamDeposition->write((char*)&iEvent, sizeof(int));
+            depo << char(0xEE);
+             depo.write((char*)&iEvent, sizeof(int));
         }
         else
-            *outStreamDeposition << EventId.data() << std::endl;
+            depo << EventId.data() << std::endl;
     }
 
-    if (CollectHistory != SessionManager::NotCollecting)
+    if (C.CollectHistory != SessionManager::NotCollecting)
         if (outStreamHistory)
         {
+            std::ostringstream & history = C.HistoryStream;
             if (bBinaryOutput)
             {
-                *outStreamHistory << char(0xEE);
-                 outStreamHistory->write((char*)&iEvent, sizeof(int));
+                history << char(0xEE);
+                 history.write((char*)&iEvent, sizeof(int));
             }
             else
-                *outStreamHistory << EventId.data() << std::endl;
+                history << EventId.data() << std::endl;
         }
 
-    if (outStreamExit)
+    if (outStreamExit || bExitToMemory)
     {
+        std::ostringstream & exits = C.ExitStream;
         if (bExitBinary)
         {
-            *outStreamExit << char(0xEE);
-             outStreamExit->write((char*)&iEvent, sizeof(int));
+            exits << char(0xEE);
+             exits.write((char*)&iEvent, sizeof(int));
         }
         else
-            *outStreamExit << EventId.data() << std::endl;
+            exits << EventId.data() << std::endl;
     }
 }
 
-void SessionManager::saveDepoRecord(int iPart, int iMat, double edep, double *pos, double time)
+void SessionManager::saveDepoRecord(int iPart, int iMat, double edep, double *pos, double time, double weight)
 {
     if (!outStreamDeposition) return;
+    std::ostringstream & depo = getContext().DepoStream;
 
     // format:
-    // partId matId DepoE X Y Z Time
+    // partId matId DepoE X Y Z Time [Weight]
 
+    const bool bWeighted = (weight != 1.0);
     if (bBinaryOutput)
     {
-        *outStreamDeposition << char(0xFF);
-
-        outStreamDeposition->write((char*)&iPart,   sizeof(int));
-        outStreamDeposition->write((char*)&iMat,    sizeof(int));
-        outStreamDeposition->write((char*)&edep,    sizeof(double));
-        outStreamDeposition->write((char*)pos,    3*sizeof(double));
-        outStreamDeposition->write((char*)&time,    sizeof(double));
+        depo << char(bWeighted ? 0xFE : 0xFF);
+
+        depo.write((char*)&iPart,   sizeof(int));
+        depo.write((char*)&iMat,    sizeof(int));
+        depo.write((char*)&edep,    sizeof(double));
+        depo.write((char*)pos,    3*sizeof(double));
+        depo.write((char*)&time,    sizeof(double));
+        if (bWeighted) depo.write((char*)&weight, sizeof(double));
     }
     else
     {
@@ -630,8 +1536,9 @@ void SessionManager::saveDepoRecord(int iPart, int iMat, double edep, double *po
         ss << edep << ' ';
         ss << pos[0] << ' ' << pos[1] << ' ' << pos[2] << ' ';
         ss << time;
+        if (bWeighted) ss << ' ' << weight;
 
-        *outStreamDeposition << ss.rdbuf() << std::endl;
+        depo << ss.rdbuf() << std::endl;
     }
 }
 
@@ -641,29 +1548,30 @@ void SessionManager::saveTrackStart(int trackID, int parentTrackID,
                                     int iMat, const std::string &volName, int volIndex)
 {
     if (!outStreamHistory) return;
+    std::ostringstream & history = getContext().HistoryStream;
 
     if (bBinaryOutput)
     {
         //format:
         //F0 trackId(int) parentTrackId(int) PartName(string) 0 X(double) Y(double) Z(double) time(double) kinEnergy(double) NextMat(int) NextVolNmae(string) 0 NextVolIndex(int)
-        *outStreamHistory << char(0xF0);
+        history << char(0xF0);
 
-        outStreamHistory->write((char*)&trackID,       sizeof(int));
-        outStreamHistory->write((char*)&parentTrackID, sizeof(int));
+        history.write((char*)&trackID,       sizeof(int));
+        history.write((char*)&parentTrackID, sizeof(int));
 
-        *outStreamHistory << particleName << char(0x00);
+        history << particleName << char(0x00);
 
         double posArr[3];
         posArr[0] = pos.x();
         posArr[1] = pos.y();
         posArr[2] = pos.z();
-        outStreamHistory->write((char*)posArr,  3*sizeof(double));
-        outStreamHistory->write((char*)&time,     sizeof(double));
-        outStreamHistory->write((char*)&kinE,     sizeof(double));
+        history.write((char*)posArr,  3*sizeof(double));
+        history.write((char*)&time,     sizeof(double));
+        history.write((char*)&kinE,     sizeof(double));
 
-        outStreamHistory->write((char*)&iMat,     sizeof(int));
-        *outStreamHistory << volName << char(0x00);
-        outStreamHistory->write((char*)&volIndex, sizeof(int));
+        history.write((char*)&iMat,     sizeof(int));
+        history << volName << char(0x00);
+        history.write((char*)&volIndex, sizeof(int));
     }
     else
     {
@@ -684,7 +1592,7 @@ void SessionManager::saveTrackStart(int trackID, int parentTrackID,
         ss << volName << ' ';
         ss << volIndex;
 
-        *outStreamHistory << ss.rdbuf() << std::endl;
+        history << ss.rdbuf() << std::endl;
     }
 
 }
@@ -696,6 +1604,7 @@ void SessionManager::saveTrackRecord(const std::string & procName,
                                      int iMatTo, const std::string & volNameTo, int volIndexTo)
 {
     if (!outStreamHistory) return;
+    std::ostringstream & history = getContext().HistoryStream;
 
     // format for "T" processes:
     // ascii: ProcName  X Y Z Time KinE DirectDepoE iMatTo VolNameTo  VolIndexTo [secondaries] \n
@@ -704,34 +1613,34 @@ void SessionManager::saveTrackRecord(const std::string & procName,
     // not that if energy depo is present on T step, it is in the previous volume!
     if (bBinaryOutput)
     {
-        *outStreamHistory << char( iMatTo == -1 ? 0xFF    // not a transportation step
+        history << char( iMatTo == -1 ? 0xFF    // not a transportation step
                                                 : 0xF8 ); // transportation step, next volume/material is saved too
 
-        *outStreamHistory << procName << char(0x00);
+        history << procName << char(0x00);
 
         double posArr[3];
         posArr[0] = pos.x();
         posArr[1] = pos.y();
         posArr[2] = pos.z();
-        outStreamHistory->write((char*)posArr,  3*sizeof(double));
-        outStreamHistory->write((char*)&time,     sizeof(double));
+        history.write((char*)posArr,  3*sizeof(double));
+        history.write((char*)&time,     sizeof(double));
 
-        outStreamHistory->write((char*)&kinE,     sizeof(double));
-        outStreamHistory->write((char*)&depoE,    sizeof(double));
+        history.write((char*)&kinE,     sizeof(double));
+        history.write((char*)&depoE,    sizeof(double));
 
         if (iMatTo != -1)
         {
-            outStreamHistory->write((char*)&iMatTo,     sizeof(int));
-            *outStreamHistory << volNameTo << char(0x00);
-            outStreamHistory->write((char*)&volIndexTo, sizeof(int));
+            history.write((char*)&iMatTo,     sizeof(int));
+            history << volNameTo << char(0x00);
+            history.write((char*)&volIndexTo, sizeof(int));
         }
 
         int numSec = (secondaries ? secondaries->size() : 0);
-        outStreamHistory->write((char*)&numSec, sizeof(int));
+        history.write((char*)&numSec, sizeof(int));
         if (secondaries)
         {
             for (const int & iSec : *secondaries)
-                outStreamHistory->write((char*)&iSec, sizeof(int));
+                history.write((char*)&iSec, sizeof(int));
         }
     }
     else
@@ -761,7 +1670,7 @@ void SessionManager::saveTrackRecord(const std::string & procName,
                 ss << ' ' << isec;
         }
 
-        *outStreamHistory << ss.rdbuf() << std::endl;
+        history << ss.rdbuf() << std::endl;
     }
 }
 
@@ -788,15 +1697,21 @@ void SessionManager::findExitVolume()
     bExitParticles = false;
 }
 
-void SessionManager::saveParticle(const G4String &particle, double energy, double time, double *PosDir)
+void SessionManager::saveParticle(const G4String &particle, double energy, double time, double *PosDir, double weight)
 {
+    if (!outStreamExit && !bExitToMemory) return;
+    std::ostringstream & exits = getContext().ExitStream;
+
+    // same record formats as in the files with primaries
+    const bool bWeighted = (weight != 1.0);
     if (bExitBinary)
     {
-        *outStreamExit << char(0xFF);
-        *outStreamExit << particle << char(0x00);
-        outStreamExit->write((char*)&energy,  sizeof(double));
-        outStreamExit->write((char*)PosDir, 6*sizeof(double));
-        outStreamExit->write((char*)&time,    sizeof(double));
+        exits << char(bWeighted ? 0xFE : 0xFF);
+        exits << particle << char(0x00);
+        exits.write((char*)&energy,  sizeof(double));
+        exits.write((char*)PosDir, 6*sizeof(double));
+        exits.write((char*)&time,    sizeof(double));
+        if (bWeighted) exits.write((char*)&weight, sizeof(double));
     }
     else
     {
@@ -808,8 +1723,9 @@ void SessionManager::saveParticle(const G4String &particle, double energy, doubl
         ss << PosDir[0] << ' ' << PosDir[1] << ' ' << PosDir[2] << ' ';     //position
         ss << PosDir[3] << ' ' << PosDir[4] << ' ' << PosDir[5] << ' ';     //direction
         ss << time;
+        if (bWeighted) ss << ' ' << weight;
 
-        *outStreamExit << ss.rdbuf() << std::endl;
+        exits << ss.rdbuf() << std::endl;
     }
 }
 
@@ -859,6 +1775,7 @@ void SessionManager::prepareMonitors()
 {
     for (MonitorSensitiveDetector * m : Monitors)
     {
+        m->pParticleDefinition = nullptr;
         if (!m->ParticleName.empty())
             m->pParticleDefinition = G4ParticleTable::GetParticleTable()->FindParticle(m->ParticleName);
     }
@@ -874,6 +1791,9 @@ void SessionManager::ReadConfig(const std::string &ConfigFileName)
 
     std::cout << s << std::endl;
 
+    WarningMessages.clear();
+    EstimateEvents = 0; // set from the command line, see setEstimateMode
+
     std::string err;
     json11::Json jo = json11::Json::parse(s, err);
     if (!err.empty()) terminateSession(err);
@@ -895,9 +1815,25 @@ void SessionManager::ReadConfig(const std::string &ConfigFileName)
     if (jo.object_items().count("Primaries_G4ants") != 0) bG4antsPrimaries = jo["Primaries_G4ants"].bool_value();
     bBinaryPrimaries = false;
     if (jo.object_items().count("Primaries_Binary") != 0) bBinaryPrimaries = jo["Primaries_Binary"].bool_value();
+    PrefetchEvents = 8;
+    // event range of the file with primaries (0-based indexes of the events in the file); faster with the index (G4ants config.json --index)
+    FirstEventToRead = std::max(0, jo["Primaries_FirstEvent"].int_value());
+    NumEventsToRead  = -1;
+    if (jo.object_items().count("Primaries_NumEvents") != 0) NumEventsToRead = std::max(0, jo["Primaries_NumEvents"].int_value());
+    if (jo.object_items().count("PrefetchEvents") != 0) PrefetchEvents = jo["PrefetchEvents"].int_value();
+    // built-in source (see PrimarySource) instead of the file with primaries
+    PrimarySourceConfig = jo["PrimarySource"];
+    bPrimarySource = PrimarySourceConfig.is_object();
     //extracting name of the file with primaries to generate
     FileName_Input = jo["File_Primaries"].string_value();
-    if (FileName_Input.empty())
+    if (bStageInput)
+    {
+        // started by the previous stage: its exit particles come through the standard input
+        FileName_Input = "-";
+        bG4antsPrimaries = bBinaryPrimaries = true;
+        bPrimarySource = false;
+    }
+    if (FileName_Input.empty() && !bPrimarySource)
         terminateSession("File name with primaries to generate was not provided");
 
     //extracting name of the file for deposition output
@@ -945,7 +1881,19 @@ void SessionManager::ReadConfig(const std::string &ConfigFileName)
     Seed = jo["Seed"].int_value();
     if (Seed == 0)
         terminateSession("Seed: read from the config file failed");
-    std::cout << "Random generator seed: " << Seed << std::endl;
+    bPerEventSeeding = jo["PerEventSeeding"].bool_value();
+    std::cout << "Random generator seed: " << Seed << "  Seeded per event? " << bPerEventSeeding << std::endl;
+
+    RandomEngineName = jo["RandomEngine"].string_value();
+    if (RandomEngineName.empty()) RandomEngineName = "Ranecu";
+    const std::vector<std::string> engines = {"Ranecu", "MixMax", "Ranlux", "Ranlux64", "MTwist"
+#ifdef GEANT_VERSION_FROM_11
+                                              , "Ranluxpp"
+#endif
+                                             };
+    if (std::find(engines.begin(), engines.end(), RandomEngineName) == engines.end())
+        terminateSession("Unknown random engine: " + RandomEngineName);
+    std::cout << "Random engine: " << RandomEngineName << std::endl;
 
     //extracting particle info
     ParticleJsonArray = jo["Particles"].array_items();
@@ -1011,6 +1959,39 @@ void SessionManager::ReadConfig(const std::string &ConfigFileName)
 
     bGuiMode = jo["GuiMode"].bool_value();
 
+    NumThreads = 1;
+    if (jo.object_items().count("NumThreads") != 0) NumThreads = jo["NumThreads"].int_value();
+
+    bTasking = false;
+    TaskGrainSize = 0;
+    if (jo.object_items().count("Tasking") != 0)
+    {
+        json11::Json jsTask = jo["Tasking"];
+        bTasking = jsTask["Enabled"].bool_value();
+        if (jsTask["PoolSize"].is_number()) NumThreads = jsTask["PoolSize"].int_value();
+        TaskGrainSize = jsTask["GrainSize"].int_value(); // 0 -> Geant4 default (pool size)
+    }
+
+    if (NumThreads < 1) NumThreads = 1;
+
+    // multi-process mode: the workers are forked after initialization, which is not safe with threads
+    NumProcesses = jo["NumProcesses"].int_value();
+    if (NumProcesses > 1 && (NumThreads > 1 || bTasking))
+    {
+        WarningMessages.push_back("NumProcesses cannot be combined with multithreading: running single-threaded workers");
+        NumThreads = 1;
+        bTasking = false;
+    }
+
+    if ((NumThreads > 1 || bTasking) && bUseThermalScatteringNeutronPhysics)
+    {
+        // the neutron processes are replaced on the master only (see activateNeutronThermalScatteringPhysics)
+        WarningMessages.push_back("Thermal neutron scattering physics is not supported in multithreaded mode: running with one thread");
+        NumThreads = 1;
+        bTasking = false;
+    }
+    std::cout << "Number of threads: " << NumThreads << "  Task-based? " << bTasking << "  Number of processes: " << std::max(1, NumProcesses) << std::endl;
+
     if (jo.object_items().count("BinaryOutput") == 0)
         bBinaryOutput = false;
     else
@@ -1029,6 +2010,7 @@ void SessionManager::ReadConfig(const std::string &ConfigFileName)
 
         FileName_Exit    = jsExit["FileName"].string_value();
         ExitVolumeName   = jsExit["VolumeName"].string_value();
+        NextStageConfig  = jsExit["NextStage"].string_value();
 
         ExitTimeFrom     = jsExit["TimeFrom"].number_value();
         ExitTimeTo       = jsExit["TimeTo"].number_value();
@@ -1040,6 +2022,57 @@ void SessionManager::ReadConfig(const std::string &ConfigFileName)
 
     NumEventsToDo = jo["NumEvents"].int_value();
 
+    MaxWallTime = jo["MaxWallTime"].number_value(); // seconds
+
+    // per-event watchdog: an event exceeding a limit is aborted and its primaries are logged
+    MaxStepsPerEvent   = 0;
+    MaxTracksPerEvent  = 0;
+    MaxCpuTimePerEvent = 0;
+    FileName_Aborted.clear();
+    if (jo.object_items().count("EventLimits") != 0)
+    {
+        json11::Json jsLim = jo["EventLimits"];
+        MaxStepsPerEvent   = (long)jsLim["MaxSteps"].number_value();
+        MaxTracksPerEvent  = jsLim["MaxTracks"].int_value();
+        MaxCpuTimePerEvent = jsLim["MaxCpuTime"].number_value(); // seconds
+        FileName_Aborted   = jsLim["FileName"].string_value();
+    }
+    bEventLimits = (MaxStepsPerEvent > 0 || MaxTracksPerEvent > 0 || MaxCpuTimePerEvent > 0);
+    if (FileName_Aborted.empty()) FileName_Aborted = FileName_Output + ".aborted";
+    if (bEventLimits)
+        std::cout << "Event limits: steps " << MaxStepsPerEvent << "  tracks " << MaxTracksPerEvent << "  CPU time " << MaxCpuTimePerEvent << " s" << std::endl;
+
+    bCheckpoint = false;
+    if (jo.object_items().count("Checkpoint") != 0)
+    {
+        json11::Json jsCheck = jo["Checkpoint"];
+        bCheckpoint         = jsCheck["Enabled"].bool_value();
+        CheckpointEvents    = jsCheck["Events"].int_value();
+        FileName_Checkpoint = jsCheck["FileName"].string_value();
+    }
+    if (FileName_Checkpoint.empty()) FileName_Checkpoint = FileName_Receipt + ".checkpoint";
+    if (bCheckpoint && CheckpointEvents < 1)
+        terminateSession("Checkpoint: the number of events between checkpoints is not provided");
+    if (bCheckpoint && NumProcesses > 1)
+    {
+        WarningMessages.push_back("Checkpoints are not supported in multi-process mode");
+        bCheckpoint = false;
+    }
+    if (bCheckpoint)
+        std::cout << "Checkpoint every " << CheckpointEvents << " events to " << FileName_Checkpoint << std::endl;
+
+    bExitToMemory = false;
+    if (!bExitParticles) NextStageConfig.clear();
+    if (!NextStageConfig.empty())
+    {
+        bExitBinary = true; // lossless, read by the next stage as G4ants binary primaries
+        bExitToMemory = FileName_Exit.empty();
+        // the shards and the resumed sessions have only a part of the events in memory
+        if (bExitToMemory && (NumProcesses > 1 || bCheckpoint))
+            terminateSession("SaveExitParticles: FileName is required for NextStage in multi-process mode and with checkpoints");
+        std::cout << "Exit particles are the primaries of the next stage: " << NextStageConfig << (bExitToMemory ? " (kept in memory)" : "") << std::endl;
+    }
+
     bool bBuildTracks = jo["BuildTracks"].bool_value();
     bool bLogHistory = jo["LogHistory"].bool_value();
     TracksToBuild = jo["MaxTracks"].int_value();
@@ -1051,8 +2084,46 @@ void SessionManager::ReadConfig(const std::string &ConfigFileName)
     else if (bBuildTracks && TracksToBuild > 0) CollectHistory = OnlyTracks;
     else CollectHistory = NotCollecting;
 
+    MaxPrimariesPerEvent = jo["MaxPrimariesPerEvent"].int_value();
+    if (MaxPrimariesPerEvent > 0 && CollectHistory != NotCollecting)
+    {
+        // track IDs restart in every sub-event: the history would be ambiguous
+        WarningMessages.push_back("MaxPrimariesPerEvent is ignored when tracks/history are collected");
+        MaxPrimariesPerEvent = 0;
+    }
+
+    // phase-space recycling: every event of the file is simulated Times times (see RecycleTimes)
+    RecycleTimes = 1;
+    if (jo["Recycling"].is_object())
+    {
+        const json11::Json & jsRec = jo["Recycling"];
+        RecycleTimes   = std::max(1, jsRec["Times"].int_value());
+        bRecycleRotate = true;
+        if (jsRec.object_items().count("Rotate") != 0) bRecycleRotate = jsRec["Rotate"].bool_value();
+        bRecycleMirror = jsRec["Mirror"].bool_value();
+
+        RecycleAxis   = {0, 0, 1};
+        RecycleCenter = {0, 0, 0};
+        const std::vector<json11::Json> & axis   = jsRec["Axis"].array_items();
+        const std::vector<json11::Json> & center = jsRec["Center"].array_items();
+        if (axis.size() == 3)   RecycleAxis   = {axis[0].number_value(),   axis[1].number_value(),   axis[2].number_value()};
+        if (center.size() == 3) RecycleCenter = {center[0].number_value(), center[1].number_value(), center[2].number_value()};
+        if (RecycleAxis.mag2() == 0) terminateSession("Recycling: axis is a zero vector");
+        RecycleAxis = RecycleAxis.unit();
+    }
+    if (RecycleTimes > 1 && CollectHistory != NotCollecting)
+    {
+        // the copies are sub-events: the same problem with the track IDs
+        WarningMessages.push_back("Recycling is ignored when tracks/history are collected");
+        RecycleTimes = 1;
+    }
+    if (RecycleTimes > 1)
+        std::cout << "Recycling: every event is simulated " << RecycleTimes << " times" << std::endl;
+
     Precision = jo["Precision"].int_value();
 
+    MonitorNames.clear();
+    bMonitorsRequireSteppingAction = false;
     if (!FileName_Monitors.empty()) //compatibility while the corresponding ANTS version is not on master
     {
         std::vector<json11::Json> MonitorArray = jo["Monitors"].array_items();
@@ -1060,54 +2131,114 @@ void SessionManager::ReadConfig(const std::string &ConfigFileName)
         {
             const json11::Json & mjs = MonitorArray[i];
             std::string Name = mjs["Name"].string_value();
-            MonitorSensitiveDetector * mobj = new MonitorSensitiveDetector(Name);
+            MonitorNames.push_back(Name);
+            MonitorSensitiveDetector * mobj = nullptr;
+            if (i < Monitors.size())
+                mobj = Monitors[i]; // server mode: the monitor is already attached to the geometry (a different layout restarts the server)
+            else
+            {
+                mobj = new MonitorSensitiveDetector(Name);
+                Monitors.push_back(mobj);
+            }
             mobj->readFromJson(mjs);
-            Monitors.push_back(mobj);
             if (!mobj->bAcceptDirect || !mobj->bAcceptIndirect) bMonitorsRequireSteppingAction = true;
         }
         std::cout << "Monitors require stepping action: " << bMonitorsRequireSteppingAction << std::endl;
     }
 }
 
-void SessionManager::prepareInputStream()
+PrimariesReader * SessionManager::openPrimariesReader()
 {
-    if (bG4antsPrimaries && bBinaryPrimaries)
-    {
-        inStreamPrimaries = new std::ifstream(FileName_Input, std::ios::in | std::ios::binary);
-        if (!inStreamPrimaries->is_open()) terminateSession("Cannot open binary file with primaries");
+    // "-" - standard input; a named pipe is given by its name
+    const std::string fileName = (FileName_Input == "-" ? "/dev/stdin" : FileName_Input);
 
-        int eventId;
-        char ch = (char)0x00;
-        inStreamPrimaries->get(ch);
-        if (ch == (char)0xEE)
+    PrimariesReader * reader = nullptr;
+    if (bPrimarySource)
+    {
+        reader = new PrimarySource(PrimarySourceConfig, Seed);
+        reader->open(fileName);
+    }
+    else if (bG4antsPrimaries && bBinaryPrimaries)
+    {
+        // mapped if possible; the stream reader is the fallback for pipes and other non-regular files
+        reader = new MappedBinaryPrimariesReader();
+        if (!reader->open(fileName))
         {
-            inStreamPrimaries->read((char*)&eventId, sizeof(int));
-            EventId = '#' + std::to_string(eventId);
+            delete reader;
+            reader = new BinaryPrimariesReader();
+            if (!reader->open(fileName)) terminateSession("Cannot open binary file with primaries");
         }
-
-        if (ch != (char)0xEE || inStreamPrimaries->fail())
-            terminateSession("Unexpected format of the binary file with primaries");
     }
     else
     {
-        inStreamPrimaries = new std::ifstream(FileName_Input);
-        if (!inStreamPrimaries->is_open()) terminateSession("Cannot open file with primaries");
+        reader = new TextPrimariesReader(bG4antsPrimaries ? nullptr : &ParticleCollection);
+        if (!reader->open(fileName)) terminateSession("Cannot open file with primaries");
+    }
+    return reader;
+}
+
+void SessionManager::prepareInputStream()
+{
+    delete inPrimaries;
+    inPrimaries = openPrimariesReader();
+
+    // the names are resolved here, in the master thread: the ions are then created before the reader thread and the workers need them
+    std::unordered_set<std::string> names;
+    inPrimaries->collectParticleNames(names, ParticleNameScanBytes);
+    for (const std::string & name : names) findGeant4Particle(name);
+
+    if (PrefetchEvents > 0) inPrimaries = new PrefetchingPrimariesReader(inPrimaries, PrefetchEvents);
+
+    // the index (see --index) is optional: without it the events are skipped by scanning
+    delete inIndex;
+    inIndex = new PrimariesIndex();
+    if (!bPrimarySource && inIndex->open(FileName_Input))
+        std::cout << "Using index of the file with primaries: " << inIndex->size() << " events" << std::endl;
+    else
+    {
+        delete inIndex;
+        inIndex = nullptr;
+    }
+
+    EventsRead       = 0;
+    EventsHandedOut  = 0;
+    NextEventToWrite = 0;
+    PendingOutput.clear();
+    SplitPrimaries.clear();
+    SampleEvents.clear();
+
+    if (!inPrimaries->isSeekable())
+    {
+        if (bResume) terminateSession("Cannot resume: the primaries are read from a pipe");
+        if (bCheckpoint)
+        {
+            WarningMessages.push_back("Checkpoints are not supported when the primaries are read from a pipe");
+            bCheckpoint = false;
+        }
+    }
 
-        getline( *inStreamPrimaries, EventId );
-        if (EventId.size()<2 || EventId[0] != '#') terminateSession("Unexpected format of the file with primaries");
+    if (bResume)
+    {
+        inPrimaries->setPosition((long)ResumeCheckpoint["InputPosition"].number_value(), ResumeCheckpoint["NextEventId"].string_value());
+        if (inPrimaries->isExhausted()) terminateSession("Cannot resume: failed to position the file with primaries");
     }
+    else skipEvents(FirstEventToRead);
+
+    MaxEventsToRead = -1;
+    if (NumEventsToRead >= 0) MaxEventsToRead = std::max(0L, NumEventsToRead - (bResume ? (long)EventsDone : 0L));
 
-    std::cout << EventId << std::endl;
+    std::cout << inPrimaries->NextEventId << std::endl;
 }
 
 void SessionManager::prepareOutputDepoStream()
 {
     outStreamDeposition = new std::ofstream();
 
+    const std::ios::openmode mode = resumeOutputFile(FileName_Output, "DepositionSize");
     if (bBinaryOutput)
-        outStreamDeposition->open(FileName_Output, std::ios::out | std::ios::binary);
+        outStreamDeposition->open(FileName_Output, std::ios::out | std::ios::binary | mode);
     else
-        outStreamDeposition->open(FileName_Output);
+        outStreamDeposition->open(FileName_Output, std::ios::out | mode);
 
     if (!outStreamDeposition->is_open())
         terminateSession("Cannot open file to store deposition data");
@@ -1117,10 +2248,11 @@ void SessionManager::prepareOutputHistoryStream()
 {
     outStreamHistory = new std::ofstream();
 
+    const std::ios::openmode mode = resumeOutputFile(FileName_Tracks, "HistorySize");
     if (bBinaryOutput)
-        outStreamHistory->open(FileName_Tracks, std::ios::out | std::ios::binary);
+        outStreamHistory->open(FileName_Tracks, std::ios::out | std::ios::binary | mode);
     else
-        outStreamHistory->open(FileName_Tracks);
+        outStreamHistory->open(FileName_Tracks, std::ios::out | mode);
 
     if (!outStreamHistory->is_open())
         terminateSession("Cannot open file to export history/tracks data");
@@ -1128,17 +2260,135 @@ void SessionManager::prepareOutputHistoryStream()
 
 void SessionManager::prepareOutputExitStream()
 {
+    ExitBuffer.clear();
+    if (bExitToMemory) return;
+
     outStreamExit = new std::ofstream();
 
+    const std::ios::openmode mode = resumeOutputFile(FileName_Exit, "ExitSize");
     if (bExitBinary)
-        outStreamExit->open(FileName_Exit, std::ios::out | std::ios::binary);
+        outStreamExit->open(FileName_Exit, std::ios::out | std::ios::binary | mode);
     else
-        outStreamExit->open(FileName_Exit);
+        outStreamExit->open(FileName_Exit, std::ios::out | mode);
 
     if (!outStreamExit->is_open())
         terminateSession("Cannot open file to export exiting particle data");
 }
 
+void SessionManager::prepareOutputAbortedStream()
+{
+    outStreamAborted = new std::ofstream();
+    outStreamAborted->open(FileName_Aborted, std::ios::out | resumeOutputFile(FileName_Aborted, "AbortedSize"));
+    if (!outStreamAborted->is_open())
+        terminateSession("Cannot open file to log aborted events");
+    *outStreamAborted << std::setprecision(std::numeric_limits<double>::max_digits10);
+}
+
+std::ios::openmode SessionManager::resumeOutputFile(const std::string & fileName, const std::string & sizeKey)
+{
+    if (!bResume) return std::ios::trunc;
+
+    // the output written after the checkpoint is discarded
+    const off_t size = (off_t)ResumeCheckpoint[sizeKey].number_value();
+    struct stat st;
+    if (stat(fileName.data(), &st) != 0 || st.st_size < size || truncate(fileName.data(), size) != 0)
+        terminateSession("Cannot resume: output file " + fileName + " does not match the checkpoint");
+    return std::ios::app;
+}
+
+void SessionManager::writeCheckpoint()
+{
+    // called between the runs: all events handed out to the threads are finished and written
+    if (!SplitPrimaries.empty() || !PendingOutput.empty()) return; // not at an event boundary
+    if (!inPrimaries || inPrimaries->isExhausted()) return;        // all events are done
+
+    json11::Json::object js;
+    js["File_Primaries"]   = FileName_Input;
+    js["File_Deposition"]  = FileName_Output;
+    js["InputPosition"]    = (double)inPrimaries->getPosition();
+    js["NextEventId"]      = inPrimaries->NextEventId;
+    js["EventsDone"]       = EventsDone;
+
+    js["EventsAborted"]    = EventsAborted;
+
+    std::ofstream * streams[]   = {outStreamDeposition, outStreamHistory, outStreamExit,  outStreamAborted};
+    const std::string * names[] = {&FileName_Output,    &FileName_Tracks, &FileName_Exit, &FileName_Aborted};
+    const char * keys[]         = {"DepositionSize",    "HistorySize",    "ExitSize",     "AbortedSize"};
+    for (int i = 0; i < 4; i++)
+    {
+        if (!streams[i]) continue;
+        streams[i]->flush();
+        struct stat st;
+        if (stat(names[i]->data(), &st) == 0) js[keys[i]] = (double)st.st_size;
+    }
+
+    js["DepoByRegistered"]    = DepoByRegistered;
+    js["DepoByNotRegistered"] = DepoByNotRegistered;
+    json11::Json::array NRP;
+    for (const std::string & snr : SeenNotRegisteredParticles)
+        NRP.push_back(snr);
+    js["SeenNotRegisteredParticles"] = NRP;
+
+    json11::Json::array Arr;
+    for (MonitorSensitiveDetector * mon : Monitors)
+    {
+        json11::Json::object json;
+        mon->writeToJson(json, true); // the auto ranges are not chosen yet: the run continues after the checkpoint
+        Arr.push_back(json);
+    }
+    js["Monitors"] = Arr;
+
+    // MT: the workers are seeded from the master engine at the start of every run
+    json11::Json::array Rng;
+    for (unsigned long v : G4Random::getTheEngine()->put())
+        Rng.push_back((double)v);
+    js["RandomEngine"] = Rng;
+
+    // write and rename: a crash during the write leaves the previous checkpoint intact
+    const std::string tmpFileName = FileName_Checkpoint + ".tmp";
+    std::ofstream outStream(tmpFileName);
+    outStream << json11::Json(js).dump() << std::endl;
+    outStream.close();
+    if (outStream.fail() || std::rename(tmpFileName.data(), FileName_Checkpoint.data()) != 0)
+        WarningMessages.push_back("Failed to write checkpoint file " + FileName_Checkpoint);
+}
+
+void SessionManager::readCheckpoint()
+{
+    std::ifstream in(FileName_Checkpoint);
+    if (!in.is_open()) terminateSession("Cannot resume: checkpoint file " + FileName_Checkpoint + " not found");
+    std::stringstream ss;
+    ss << in.rdbuf();
+
+    std::string err;
+    ResumeCheckpoint = json11::Json::parse(ss.str(), err);
+    if (!err.empty()) terminateSession("Cannot resume: bad format of the checkpoint file: " + err);
+    if (ResumeCheckpoint["File_Primaries"].string_value() != FileName_Input || ResumeCheckpoint["File_Deposition"].string_value() != FileName_Output)
+        terminateSession("Cannot resume: the checkpoint was made for a different config");
+
+    EventsDone    = ResumeCheckpoint["EventsDone"].int_value();
+    EventsAborted = ResumeCheckpoint["EventsAborted"].int_value();
+    std::cout << "Resuming after " << EventsDone << " events" << std::endl;
+
+    DepoByRegistered    = ResumeCheckpoint["DepoByRegistered"].number_value();
+    DepoByNotRegistered = ResumeCheckpoint["DepoByNotRegistered"].number_value();
+    for (const json11::Json & j : ResumeCheckpoint["SeenNotRegisteredParticles"].array_items())
+        SeenNotRegisteredParticles.insert(j.string_value());
+
+    const std::vector<json11::Json> & arMon = ResumeCheckpoint["Monitors"].array_items();
+    for (size_t i = 0; i < arMon.size() && i < Monitors.size(); i++)
+    {
+        Monitors[i]->clearData();
+        Monitors[i]->mergeFromJson(arMon[i]);
+    }
+
+    std::vector<unsigned long> Rng;
+    for (const json11::Json & j : ResumeCheckpoint["RandomEngine"].array_items())
+        Rng.push_back((unsigned long)j.number_value());
+    if (!G4Random::getTheEngine()->get(Rng))
+        terminateSession("Cannot resume: failed to restore the random engine state");
+}
+
 void SessionManager::executeAdditionalCommands()
 {
     G4UImanager* UImanager = G4UImanager::GetUIpointer();
@@ -1148,6 +2398,35 @@ void SessionManager::executeAdditionalCommands()
     UImanager->ApplyCommand("/run/initialize");
 }
 
+void SessionManager::prepareContexts()
+{
+    std::lock_guard<std::mutex> lock(ContextMutex);
+    for (SessionContext * C : Contexts)
+    {
+        C->CollectHistory = CollectHistory;
+        C->NextTrackID = 1;
+        C->bStoppedOnMonitor = false;
+        C->DepoByRegistered = 0;
+        C->DepoByNotRegistered = 0;
+        C->SeenNotRegisteredParticles.clear();
+
+        // worker copies of the monitors take the settings of the current job
+        for (size_t i = 0; i < C->Monitors.size() && i < Monitors.size(); i++)
+            if (C->Monitors[i] != Monitors[i]) C->Monitors[i]->configureFrom(*Monitors[i]);
+    }
+    SeenNotRegisteredParticles.clear();
+}
+
+void SessionManager::closeStreams()
+{
+    delete inPrimaries;         inPrimaries         = nullptr;
+    delete inIndex;             inIndex             = nullptr;
+    delete outStreamDeposition; outStreamDeposition = nullptr;
+    delete outStreamHistory;    outStreamHistory    = nullptr;
+    delete outStreamExit;       outStreamExit       = nullptr;
+    delete outStreamAborted;    outStreamAborted    = nullptr;
+}
+
 void SessionManager::generateReceipt()
 {
     json11::Json::object receipt;
@@ -1155,6 +2434,14 @@ void SessionManager::generateReceipt()
     receipt["Success"] = !bError;
     if (bError) receipt["Error"] = ErrorMessage;
 
+    receipt["EventsDone"] = EventsDone;
+    receipt["RandomEngine"] = RandomEngineName;
+    receipt["Seed"] = (double)Seed;
+    if (bPerEventSeeding) receipt["PerEventSeeding"] = true;
+    if (EstimateEvents > 0) receipt["Estimate"] = EstimateReport;
+    if (bEventLimits) receipt["EventsAborted"] = EventsAborted;
+    if (bStoppedByWallTime) receipt["Interrupted"] = "Wall-clock limit reached";
+
     receipt["DepoByRegistered"] = DepoByRegistered;
     receipt["DepoByNotRegistered"] = DepoByNotRegistered;
 
@@ -1179,7 +2466,7 @@ void SessionManager::storeMonitorsData()
     for (MonitorSensitiveDetector * mon : Monitors)
     {
         json11::Json::object json;
-        mon->writeToJson(json);
+        mon->writeToJson(json, ShardIndex >= 0); // shards: the auto ranges are chosen after merging
         Arr.push_back(json);
     }
 
@@ -1196,6 +2483,10 @@ void SessionManager::storeMonitorsData()
 #include "G4SystemOfUnits.hh"
 G4ParticleDefinition * SessionManager::findGeant4Particle(const std::string & particleName)
 {
+    // the same few names are resolved for every primary; ion names (e.g. Co60[58.6]) would be parsed and looked up in the ion table each time
+    G4ParticleDefinition * Cached = findCachedGeant4Particle(particleName);
+    if (Cached) return Cached;
+
     G4ParticleDefinition * Particle = G4ParticleTable::GetParticleTable()->FindParticle(particleName);
 
     if (!Particle)
@@ -1215,9 +2506,18 @@ G4ParticleDefinition * SessionManager::findGeant4Particle(const std::string & pa
         //std::cout << particleName << "   ->   " << Particle->GetParticleName() << std::endl;
     }
 
+    std::lock_guard<std::mutex> lock(ParticleCacheMutex);
+    ParticleCache.emplace(particleName, Particle);
     return Particle;
 }
 
+G4ParticleDefinition * SessionManager::findCachedGeant4Particle(const std::string & particleName)
+{
+    std::lock_guard<std::mutex> lock(ParticleCacheMutex);
+    const auto it = ParticleCache.find(particleName);
+    return (it == ParticleCache.end() ? nullptr : it->second);
+}
+
 bool SessionManager::extractIonInfo(const std::string & text, int & Z, int & A, double & E)
 {
     size_t size = text.length();
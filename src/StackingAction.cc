@@ -15,7 +15,7 @@ G4ClassificationOfNewTrack StackingAction::ClassifyNewTrack(const G4Track * /*tr
 
     // WARNING!
     //deleting the tracks or assigning to special stacks will upset the track ID prediction system:
-    //see SM.NextTrackID
+    //see SessionContext::NextTrackID
 
     //std::stringstream ss;
     //ss << "  track created: " << track->GetTrackID() << "  before add total # of tracks: " <<stackManager->GetNTotalTrack();
@@ -1,5 +1,6 @@
 #include "SteppingAction.hh"
 #include "SessionManager.hh"
+#include "SessionContext.hh"
 
 #include "G4Step.hh"
 #include "G4StepPoint.hh"
@@ -20,6 +21,28 @@ SteppingAction::~SteppingAction(){}
 void SteppingAction::UserSteppingAction(const G4Step *step)
 {
     SessionManager & SM = SessionManager::getInstance();
+    SessionContext & C = SM.getContext();
+
+    if (SM.bEventLimits)
+    {
+        if (C.bEventAborted) return;
+
+        if (step->GetTrack()->GetCurrentStepNumber() == 1) C.EventTracks++;
+        C.EventSteps++;
+
+        std::string reason;
+        if      (SM.MaxStepsPerEvent  > 0 && C.EventSteps  > SM.MaxStepsPerEvent)  reason = "too many steps";
+        else if (SM.MaxTracksPerEvent > 0 && C.EventTracks > SM.MaxTracksPerEvent) reason = "too many tracks";
+        else if (SM.MaxCpuTimePerEvent > 0 && (C.EventSteps & 0x3FF) == 0)          // the clock is checked every 1024 steps
+            if (SessionManager::getThreadCpuTime() - C.EventCpuStart > SM.MaxCpuTimePerEvent) reason = "CPU time limit";
+
+        if (!reason.empty())
+        {
+            step->GetTrack()->SetTrackStatus(fStopAndKill);
+            SM.abortEvent(reason);
+            return;
+        }
+    }
 
     if (SM.bExitParticles)
     {
@@ -46,12 +69,13 @@ void SteppingAction::UserSteppingAction(const G4Step *step)
                     SM.saveParticle(step->GetTrack()->GetParticleDefinition()->GetParticleName(),
                                     postP->GetKineticEnergy()/keV,
                                     time,
-                                    buf);
+                                    buf,
+                                    step->GetTrack()->GetWeight());
 
                     if (SM.bExitKill)
                         step->GetTrack()->SetTrackStatus(fStopAndKill);
 
-                    if (SM.CollectHistory != SessionManager::NotCollecting)
+                    if (C.CollectHistory != SessionManager::NotCollecting)
                     {
                         const double kinE = step->GetPostStepPoint()->GetKineticEnergy()/keV;
                         const double depoE = step->GetTotalEnergyDeposit()/keV;
@@ -72,17 +96,17 @@ void SteppingAction::UserSteppingAction(const G4Step *step)
                 step->GetTrack()->SetUserInformation(new G4VUserTrackInformation()); // owned by track!
         }
 
-    if (SM.CollectHistory == SessionManager::NotCollecting) return; // the rest is only to record telemetry!
+    if (C.CollectHistory == SessionManager::NotCollecting) return; // the rest is only to record telemetry!
 
-    if (SM.bStoppedOnMonitor) // bug fix for Geant4 - have to be removed when it is fixed! Currently track has one more step after kill
+    if (C.bStoppedOnMonitor) // bug fix for Geant4 - have to be removed when it is fixed! Currently track has one more step after kill
     {
-        SM.bStoppedOnMonitor = false;
+        C.bStoppedOnMonitor = false;
         return;
     }
 
     const G4VProcess * proc = step->GetPostStepPoint()->GetProcessDefinedStep();
     if (proc && proc->GetProcessType() == fTransportation)
-        if (step->GetPostStepPoint()->GetStepStatus() != fWorldBoundary && SM.CollectHistory == SessionManager::OnlyTracks)
+        if (step->GetPostStepPoint()->GetStepStatus() != fWorldBoundary && C.CollectHistory == SessionManager::OnlyTracks)
             return; // skip transportation if only collecting tracks
 
     bool bTransport = false;
@@ -114,8 +138,7 @@ void SteppingAction::UserSteppingAction(const G4Step *step)
         TmpSecondaries.resize(numSec);
         for (int iSec = 0; iSec < numSec; iSec++)
         {
-            TmpSecondaries[iSec] = SM.getPredictedTrackID();
-            SM.incrementPredictedTrackID();
+            TmpSecondaries[iSec] = C.NextTrackID++;
         }
         secondaries = &TmpSecondaries;
     }
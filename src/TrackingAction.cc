@@ -1,5 +1,6 @@
 #include "TrackingAction.hh"
 #include "SessionManager.hh"
+#include "SessionContext.hh"
 
 #include "G4Track.hh"
 #include "G4Step.hh"
@@ -19,7 +20,7 @@ TrackingAction::~TrackingAction(){}
 void TrackingAction::PreUserTrackingAction(const G4Track *track)
 {
     SessionManager & SM = SessionManager::getInstance();
-    if (SM.CollectHistory == SessionManager::NotCollecting) return;
+    if (SM.getContext().CollectHistory == SessionManager::NotCollecting) return;
 
     // format:
     // > TrackID ParentTrackID ParticleId X Y Z Time E iMat VolName VolIndex
@@ -56,12 +57,12 @@ void TrackingAction::PreUserTrackingAction(const G4Track *track)
 void TrackingAction::PostUserTrackingAction(const G4Track *)
 {
     SessionManager & SM = SessionManager::getInstance();
-    if (SM.CollectHistory == SessionManager::NotCollecting) return;
+    SessionContext & C = SM.getContext();
+    if (C.CollectHistory == SessionManager::NotCollecting) return;
 
-    if (SM.CollectHistory == SessionManager::OnlyTracks)
+    if (C.CollectHistory == SessionManager::OnlyTracks)
     {
-        SM.TracksToBuild--;
-        if (SM.TracksToBuild <= 0)
-            SM.CollectHistory = SessionManager::NotCollecting;
+        if (!SM.onTrackBuilt()) // the limit is shared by all threads
+            C.CollectHistory = SessionManager::NotCollecting;
     }
 }
@@ -13,10 +13,7 @@ AHistogram1D::AHistogram1D(int Bins, double From, double To) :
         deltaBin = (to - from) / bins;
     }
     else
-    {
         bFixedRange = false;
-        buffer.reserve(bufferSize);
-    }
 }
 
 void AHistogram1D::Fill(double x, double val)
@@ -33,6 +30,60 @@ void AHistogram1D::Fill(double x, double val)
     }
 }
 
+void AHistogram1D::merge(const AHistogram1D & other)
+{
+    if (!other.bFixedRange)
+    {
+        // the range of other is not yet defined: all its entries are still in the buffer
+        for (const auto & p : other.buffer)
+            Fill(p.first, p.second);
+        return;
+    }
+
+    if (!bFixedRange && buffer.empty())
+    {
+        // nothing was filled yet: take the range and the content of other
+        *this = other;
+        buffer.clear();
+        return;
+    }
+
+    if (!bFixedRange) processBuffer();
+
+    entries  += other.entries;
+    sumVal   += other.sumVal;
+    sumVal2  += other.sumVal2;
+    sumValX  += other.sumValX;
+    sumValX2 += other.sumValX2;
+
+    if (bins == other.bins && from == other.from && to == other.to)
+    {
+        for (size_t i=0; i<data.size(); i++)
+            data[i] += other.data[i];
+    }
+    else
+    {
+        data[0]      += other.data[0];
+        data[bins+1] += other.data[other.bins+1];
+        for (int i=1; i<=other.bins; i++)
+            addToBin(other.from + (i - 0.5) * other.deltaBin, other.data[i]);
+    }
+}
+
+void AHistogram1D::setContent(const std::vector<double> & content, const std::vector<double> & stat)
+{
+    if (content.size() == data.size()) data = content;
+
+    if (stat.size() == 5)
+    {
+        sumVal   = stat[0];
+        sumVal2  = stat[1];
+        sumValX  = stat[2];
+        sumValX2 = stat[3];
+        entries  = stat[4];
+    }
+}
+
 const std::vector<double> &AHistogram1D::getContent()
 {
     if (!bFixedRange) processBuffer();
@@ -61,6 +112,13 @@ void AHistogram1D::fillFixed(double x, double val)
     }
 }
 
+void AHistogram1D::addToBin(double x, double val)
+{
+    if      (x < from) data[0]      += val;
+    else if (x > to)   data[bins+1] += val;
+    else               data[ 1 + (x - from)/deltaBin ] += val;
+}
+
 void AHistogram1D::processBuffer()
 {
     if (buffer.empty()) return;
@@ -106,10 +164,7 @@ AHistogram2D::AHistogram2D(int XBins, double XFrom, double XTo, int YBins, doubl
         ydeltaBin = (yto - yfrom) / ybins;
     }
     else
-    {
         bFixedRange = false;
-        buffer.reserve(bufferSize);
-    }
 }
 
 void AHistogram2D::Fill(double x, double y, double val)
@@ -126,6 +181,72 @@ void AHistogram2D::Fill(double x, double y, double val)
     }
 }
 
+void AHistogram2D::merge(const AHistogram2D & other)
+{
+    if (!other.bFixedRange)
+    {
+        // the range of other is not yet defined: all its entries are still in the buffer
+        for (const auto & t : other.buffer)
+            Fill(std::get<0>(t), std::get<1>(t), std::get<2>(t));
+        return;
+    }
+
+    if (!bFixedRange && buffer.empty())
+    {
+        // nothing was filled yet: take the range and the content of other
+        *this = other;
+        buffer.clear();
+        return;
+    }
+
+    if (!bFixedRange) processBuffer();
+
+    entries  += other.entries;
+    sumVal   += other.sumVal;
+    sumVal2  += other.sumVal2;
+    sumValX  += other.sumValX;
+    sumValX2 += other.sumValX2;
+    sumValY  += other.sumValY;
+    sumValY2 += other.sumValY2;
+
+    if (xbins == other.xbins && xfrom == other.xfrom && xto == other.xto &&
+        ybins == other.ybins && yfrom == other.yfrom && yto == other.yto)
+    {
+        for (size_t iy=0; iy<data.size(); iy++)
+            for (size_t ix=0; ix<data[iy].size(); ix++)
+                data[iy][ix] += other.data[iy][ix];
+    }
+    else
+    {
+        // under/overflows are re-binned using the limits of other
+        for (int iy=0; iy<other.ybins+2; iy++)
+        {
+            const double y = other.yfrom + (iy - 0.5) * other.ydeltaBin;
+            for (int ix=0; ix<other.xbins+2; ix++)
+            {
+                const double x = other.xfrom + (ix - 0.5) * other.xdeltaBin;
+                addToBin(x, y, other.data[iy][ix]);
+            }
+        }
+    }
+}
+
+void AHistogram2D::setContent(const std::vector<std::vector<double> > & content, const std::vector<double> & stat)
+{
+    if (content.size() == data.size() && !content.empty() && content[0].size() == data[0].size()) data = content;
+
+    if (stat.size() == 7)
+    {
+        sumVal   = stat[0];
+        sumVal2  = stat[1];
+        sumValX  = stat[2];
+        sumValX2 = stat[3];
+        sumValY  = stat[4];
+        sumValY2 = stat[5];
+        entries  = stat[6];
+    }
+}
+
 const std::vector<std::vector<double> > & AHistogram2D::getContent()
 {
     if (!bFixedRange) processBuffer();
@@ -181,6 +302,21 @@ void AHistogram2D::fillFixed(double x, double y, double val)
     }
 }
 
+void AHistogram2D::addToBin(double x, double y, double val)
+{
+    int ixbin, iybin;
+
+    if      (x < xfrom) ixbin = 0;
+    else if (x > xto)   ixbin = xbins + 1;
+    else                ixbin = 1 + (x - xfrom)/xdeltaBin;
+
+    if      (y < yfrom) iybin = 0;
+    else if (y > yto)   iybin = ybins + 1;
+    else                iybin = 1 + (y - yfrom)/ydeltaBin;
+
+    data[iybin][ixbin] += val;
+}
+
 void AHistogram2D::processBuffer()
 {
     if (buffer.empty()) return;
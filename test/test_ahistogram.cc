@@ -0,0 +1,79 @@
+// Merging of the auto-range histograms filled in parallel (MT workers, shards)
+#include "ahistogram.hh"
+
+#include <cstdio>
+#include <vector>
+
+static int Failures = 0;
+
+static void check(bool ok, const char * what)
+{
+    if (ok) return;
+    std::printf("FAILED: %s\n", what);
+    Failures++;
+}
+
+static void test1D()
+{
+    // the two clones see different ranges of data: each of them alone would choose a different range
+    AHistogram1D a(10, 0, 0), b(10, 0, 0), all(10, 0, 0);
+    for (AHistogram1D * h : {&a, &b, &all}) h->setBufferSize(0);
+    for (int i = 0; i < 20000; i++)
+    {
+        const double x = 0.001 * i;        // 0 .. 20
+        a.Fill(x);
+        all.Fill(x);
+    }
+    for (int i = 0; i < 5000; i++)
+    {
+        const double x = 50.0 + 0.002 * i; // 50 .. 60
+        b.Fill(x, 2.0);
+        all.Fill(x, 2.0);
+    }
+
+    AHistogram1D ab(10, 0, 0), ba(10, 0, 0);
+    for (AHistogram1D * h : {&ab, &ba}) h->setBufferSize(0);
+    ab.merge(a); ab.merge(b);
+    ba.merge(b); ba.merge(a);
+
+    check(ab.getContent() == all.getContent(), "1D: merged clones differ from a single histogram");
+    check(ba.getContent() == ab.getContent(),  "1D: result depends on the merge order");
+    check(ab.getStat()    == all.getStat(),    "1D: statistics differ");
+
+    double from, to;
+    ab.getLimits(from, to);
+    check(from == 0 && to > 59.9, "1D: range does not cover the entries of both clones");
+}
+
+static void test2D()
+{
+    AHistogram2D a(5, 0, 0, 4, 0, 0), b(5, 0, 0, 4, 0, 0), all(5, 0, 0, 4, 0, 0);
+    for (AHistogram2D * h : {&a, &b, &all}) h->setBufferSize(0);
+    for (int i = 0; i < 15000; i++)
+    {
+        a.Fill(0.001 * i, -0.001 * i);
+        all.Fill(0.001 * i, -0.001 * i);
+    }
+    for (int i = 0; i < 15000; i++)
+    {
+        b.Fill(100.0 + 0.001 * i, 0.001 * i, 0.5);
+        all.Fill(100.0 + 0.001 * i, 0.001 * i, 0.5);
+    }
+
+    AHistogram2D ab(5, 0, 0, 4, 0, 0), ba(5, 0, 0, 4, 0, 0);
+    for (AHistogram2D * h : {&ab, &ba}) h->setBufferSize(0);
+    ab.merge(a); ab.merge(b);
+    ba.merge(b); ba.merge(a);
+
+    check(ab.getContent() == all.getContent(), "2D: merged clones differ from a single histogram");
+    check(ba.getContent() == ab.getContent(),  "2D: result depends on the merge order");
+}
+
+int main()
+{
+    test1D();
+    test2D();
+
+    if (Failures == 0) std::printf("All tests passed\n");
+    return (Failures == 0 ? 0 : 1);
+}
@@ -0,0 +1,115 @@
+// Round trip of the version 2 binary format of the primaries: PrimariesV2Writer and the record decoding of the readers
+#include "PrimariesV2Format.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static int Failures = 0;
+
+static void check(bool ok, const char * what)
+{
+    if (ok) return;
+    std::printf("FAILED: %s\n", what);
+    Failures++;
+}
+
+typedef PrimariesV2Format::Record Record;
+
+static Record makeRecord(int32_t index, double weight, double energy)
+{
+    Record r;
+    r.Particle = index;
+    for (int i = 0; i < 8; i++) r.Data[i] = energy + i;
+    r.setWeight(weight);
+    return r;
+}
+
+template <typename T> static T readValue(std::istream & in)
+{
+    T value{};
+    in.read((char*)&value, sizeof(T));
+    return value;
+}
+
+static void testRoundTrip()
+{
+    const std::vector<std::string> names = {"gamma", "e-", "neutron"};
+    const std::vector<Record> event0 = {makeRecord(0, 1.0, 10), makeRecord(2, 0.0, 20), makeRecord(1, 0.25, 30)};
+    const std::vector<Record> event1 = {makeRecord(1, 3.5e-12, 40)};
+
+    std::stringstream file;
+    PrimariesV2Writer writer(file, names);
+    writer.writeEvent(0, event0);
+    writer.writeEvent(7, event1);
+    writer.writeEvent(8, {});
+    check(!file.fail(), "writer failed");
+
+    char magic[8];
+    file.read(magic, sizeof(magic));
+    check(std::memcmp(magic, PrimariesV2Format::Magic, sizeof(magic)) == 0, "magic");
+
+    const uint32_t numNames = readValue<uint32_t>(file);
+    check(numNames == names.size(), "number of names");
+    for (uint32_t i = 0; i < numNames && i < names.size(); i++)
+    {
+        std::string name(readValue<uint16_t>(file), '\0');
+        file.read(&name[0], name.size());
+        check(name == names[i], "name");
+    }
+
+    const int32_t  expectedEvents[]  = {0, 7, 8};
+    const uint32_t expectedRecords[] = {3, 1, 0};
+    std::vector<Record> records;
+    for (int iEvent = 0; iEvent < 3; iEvent++)
+    {
+        check(readValue<int32_t>(file) == expectedEvents[iEvent], "event number");
+        const uint32_t numRecords = readValue<uint32_t>(file);
+        check(numRecords == expectedRecords[iEvent], "number of records");
+        for (uint32_t i = 0; i < numRecords; i++) records.push_back(readValue<Record>(file));
+    }
+    file.get();
+    check(file.eof(), "data after the last event");
+
+    const int32_t indexes[] = {0, 2, 1, 1};
+    const double  weights[] = {1.0, 0.0, 0.25, (float)3.5e-12};
+    check(records.size() == 4, "number of records in the file");
+    for (size_t i = 0; i < records.size() && i < 4; i++)
+    {
+        check(records[i].getParticleIndex() == indexes[i], "particle index");
+        check(records[i].getWeight() == weights[i], "weight");
+        check(records[i].Data[7] == 10.0 * (i + 1) + 7, "data");
+    }
+    check(records[0].Weight == 0 && records[0].Particle == 0, "weight 1 is not stored as not weighted");
+}
+
+static void testOldFiles()
+{
+    // written before the weighted flag: the weight field is either reserved (0) or holds the weight
+    Record r = makeRecord(5, 1.0, 0);
+    check(r.getWeight() == 1.0, "reserved weight field");
+    r.Weight = 2.0f;
+    check(r.getWeight() == 2.0 && r.getParticleIndex() == 5, "weight without the flag");
+
+    r.Particle = -1;
+    check(r.getParticleIndex() < 0, "corrupted index is not negative");
+}
+
+static void testLimits()
+{
+    std::stringstream file;
+    PrimariesV2Writer writer(file, {std::string(70000, 'x')});
+    check(file.fail(), "too long name is accepted");
+}
+
+int main()
+{
+    testRoundTrip();
+    testOldFiles();
+    testLimits();
+
+    if (Failures == 0) std::printf("All tests passed\n");
+    return (Failures == 0 ? 0 : 1);
+}